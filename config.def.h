@@ -22,10 +22,22 @@ static bool center_title = false;
 static bool custom_title = false;
 // title color use active colors
 static bool active_color_title = true;
-// scale
-static uint32_t buffer_scale = 1;
+// give up the exclusive zone while a client is fullscreen on the output
+static bool fullscreen_release_zone = false;
+// stop drawing bars on powered off outputs; the compositor then refuses power control to idle daemons
+static bool follow_output_power = false;
+// keep the last status and title of each output in $XDG_RUNTIME_DIR/dwlb/state-<instance> across restarts
+static bool state_file = false;
+// status text generated from built-in modules, e.g. "cpu ^cpu() mem ^mem() ^clock(%H:%M)"
+static char *status_format = NULL;
+// buffer scale for every bar, 0 to follow the scale of each output
+static uint32_t buffer_scale = 0;
 // font
 static char *fontstr = "monospace:size=16";
+// seconds a socket client may hold an unterminated command before it is dropped
+static uint32_t client_partial_timeout = 5;
+// seconds a socket client may stay silent before it is dropped, 0 to keep it forever
+static uint32_t client_idle_timeout = 600;
 // tag names
 static char *tags_names[] = { "1", "2", "3", "4", "5", "6", "7", "8", "9" };
 
@@ -1,21 +1,38 @@
 #define _GNU_SOURCE
+#include <arpa/inet.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcft/fcft.h>
 #include <fcntl.h>
+#include <ifaddrs.h>
 #include <linux/input-event-codes.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
 #include <pixman-1/pixman.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
@@ -26,6 +43,7 @@
 #include "xdg-output-unstable-v1-protocol.h"
 #include "wlr-layer-shell-unstable-v1-protocol.h"
 #include "dwl-ipc-unstable-v2-protocol.h"
+#include "wlr-output-power-management-unstable-v1-protocol.h"
 
 #define DIE(fmt, ...)						\
 	do {							\
@@ -86,6 +104,13 @@
 	"	-no-custom-title		display current window title as normal\n" \
 	"	-active-color-title		title colors will use active colors\n" \
 	"	-no-active-color-title		title colors will use inactive colors\n" \
+	"	-fullscreen-release-zone	give up the exclusive zone while a client is fullscreen\n" \
+	"	-no-fullscreen-release-zone	keep the exclusive zone while a client is fullscreen\n" \
+	"	-output-power			stop drawing bars on powered off outputs, blocks other power management clients\n" \
+	"	-no-output-power		do not follow output power states\n" \
+	"	-state-file			keep the last status and title of each output in $XDG_RUNTIME_DIR/dwlb/state-NAME\n" \
+	"	-no-state-file			keep the last status and title of each output in memory only\n" \
+	"	-status-format [FORMAT]		generate status text from built-in modules, see the manual\n" \
 	"	-font [FONT]			specify a font\n"	\
 	"	-tags [NUMBER] [FIRST]...[LAST]	if ipc is disabled, specify custom tag names. If NUMBER is 0, then no tag names should be given \n" \
 	"	-vertical-padding [PIXELS]	specify vertical pixel padding above and below text\n" \
@@ -99,9 +124,9 @@
 	"	-urgent-bg-color [COLOR]	specify background color of urgent tags\n" \
 	"	-middle-bg-color [COLOR]	specify background color of the color in the middle of the bar\n" \
 	"	-middle-bg-color-selected [COLOR]	specify background color of the color in the middle of the bar, when selected\n" \
-	"	-scale [BUFFER_SCALE]		specify buffer scale value for integer scaling\n" \
+	"	-scale [BUFFER_SCALE]		use this integer buffer scale on every output instead of each output's own, 0 to follow outputs\n" \
 	"Commands\n"							\
-	"	-target-socket [SOCKET-NAME]	set the socket to send command to. Sockets can be found in `$XDG_RUNTIME_DIR/dwlb/`\n"\
+	"	-target-socket [SOCKET-NAME]	set the socket to send command to. Running instances are listed in `$XDG_RUNTIME_DIR/dwlb/instances`\n"\
 	"	-status	[OUTPUT] [TEXT]		set status text\n"	\
 	"	-status-stdin	[OUTPUT]		set status text from stdin\n"	\
 	"	-title	[OUTPUT] [TEXT]		set title text, if -custom-title is enabled\n"	\
@@ -111,13 +136,41 @@
 	"	-set-top [OUTPUT]		draw bar at the top\n"	\
 	"	-set-bottom [OUTPUT]		draw bar at the bottom\n" \
 	"	-toggle-location [OUTPUT]	toggle bar location\n"	\
+	"	-subscribe			print bar state changes as they happen\n" \
 	"Other\n"							\
 	"	-v				get version information\n" \
 	"	-h				view this help text\n"
 
 #define TEXT_MAX 2048
+#define CLIENTS_MAX 64
+#define BATCH_MAX 65536
+#define SUBSCRIBER_BUF_MAX 65536
+#define STDIN_BUF_MAX 16384
+#define RING_SIZE 65536
+#define QUEUE_SIZE 64
+#define INDEX_SIZE 64
+#define CACHE_ENTRIES 16
+#define CACHE_MAGIC 0x64776c62
 
 enum { WheelUp, WheelDown };
+enum { EventTags = 1 << 0, EventLayout = 1 << 1, EventTitle = 1 << 2,
+       EventSelmon = 1 << 3, EventVisible = 1 << 4, EventLocation = 1 << 5,
+       EventAll = (1 << 6) - 1 };
+
+/* Regions of a bar that need to be redrawn, from left to right */
+enum { DirtyTags = 1 << 0, DirtyLayout = 1 << 1, DirtyTitle = 1 << 2,
+       DirtyStatus = 1 << 3, DirtyAll = (1 << 4) - 1 };
+
+/* Tag state is kept as three bitsets of any number of 64-bit words,
+ * one after another in the same allocation */
+enum { TagOccupied, TagActive, TagUrgent, TagSets };
+#define TAGWORDS(n) (((n) + 63) / 64)
+#define TAGSET(bits, words, set) ((bits) + (set) * (words))
+
+typedef struct {
+	uint64_t *bits;
+	uint32_t words;
+} TagBits;
 
 typedef struct {
 	pixman_color_t color;
@@ -127,64 +180,224 @@ typedef struct {
 
 typedef struct {
 	uint32_t btn;
-	uint32_t x1;
-	uint32_t x2;
+	uint32_t start, end; /* bytes of the parsed text it covers */
+	uint32_t src; /* offset of the button in the source text */
 	char command[128];
 } Button;
 
+/* Parsed status text. Immutable once parsed and shared between bars,
+ * freed when the last reference is dropped. */
 typedef struct {
 	char text[TEXT_MAX];
 	Color *colors;
 	uint32_t colors_l, colors_c;
 	Button *buttons;
 	uint32_t buttons_l, buttons_c;
+	uint32_t refs;
 } CustomText;
 
+/* Last status and custom title sent to an output. The text is kept as
+ * it was sent so it can be parsed again after a restart. */
+typedef struct {
+	char name[64];
+	uint64_t stamp; /* order of the last update, 0 if unused */
+	char status[TEXT_MAX], title[TEXT_MAX];
+} CacheEntry;
+
+/* Layout of the state file */
+typedef struct {
+	uint32_t magic, size;
+	CacheEntry entries[CACHE_ENTRIES];
+} Cache;
+
+/* Font and cursor for one buffer scale, shared by the bars of that scale
+ * and created when the first of them needs it */
 typedef struct {
+	uint32_t scale;
+	struct fcft_font *font;
+	uint32_t height, textpadding; /* height in surface coordinates */
+	struct wl_cursor_theme *cursor_theme;
+	struct wl_cursor_image *cursor_image;
+	struct wl_surface *cursor_surface;
+	struct wl_list link;
+} Scale;
+
+typedef struct Bar {
 	struct wl_output *wl_output;
 	struct wl_surface *wl_surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
+	struct wl_buffer *buffer; /* last frame, kept to be shown again */
 	struct zxdg_output_v1 *xdg_output;
 	struct zdwl_ipc_output_v2 *dwl_wm_output;
+	struct zwlr_output_power_v1 *output_power;
 
 	uint32_t registry_name;
-	char *xdg_output_name;
+	char *output_name;
+	int32_t output_scale;
+	Scale *scale;
 
 	bool configured;
 	uint32_t width, height;
 	uint32_t textpadding;
 	uint32_t stride, bufsize;
 	
-	uint32_t mtags, ctags, urg, sel;
+	TagBits tagbits;
+	uint32_t sel;
 	char *layout, *window_title;
 	uint32_t layout_idx, last_layout_idx;
-	CustomText title, status;
+	CustomText *title, *status;
+
+	/* dwl IPC state, staged until the frame event */
+	TagBits pending_tagbits;
+	uint32_t pending_sel;
+	uint32_t pending_layout_idx;
+	char *pending_layout, *pending_title;
+	bool pending_fullscreen;
 
 	bool hidden, bottom;
-	bool redraw;
+	bool fullscreen; /* a fullscreen client covers the bar, nothing is drawn */
+	bool powered_off; /* the output is off, nothing is drawn either */
+	uint32_t dirty;
+	bool rendering;
+	bool render_failed; /* retried on the next event, not right away */
+	bool drawn; /* buffer holds a frame of the current size */
+	uint32_t bounds[3]; /* where the layout, title and status of that frame start */
 
 	struct wl_list link;
+	struct Bar *name_next, *id_next; /* index chains */
 } Bar;
 
+/* Immutable copy of what a bar shows, rendered off the main thread */
+typedef struct {
+	uint32_t registry_name;
+	uint32_t width, height, stride, bufsize;
+	struct fcft_font *font;
+	uint32_t textpadding;
+	char **tags;
+	uint32_t tags_l, tagwords;
+	bool sel;
+	char *layout, *window_title;
+	CustomText *title, *status;
+	uint32_t dirty;
+	uint32_t bounds[3]; /* set by the render thread */
+	int fd; /* shm file holding the result, -1 if rendering failed */
+	uint64_t tagbits[]; /* TagSets runs of tagwords */
+} Frame;
+
 typedef struct {
+	atomic_uint head, tail;
+	Frame *items[QUEUE_SIZE];
+} Queue;
+
+/* Shared memory channel for a single status producer. The producer
+ * appends records (a uint32_t length followed by that many bytes of
+ * commands) at head and signals the eventfd; dwlb consumes from tail.
+ * Positions run freely and are taken modulo size. */
+typedef struct {
+	atomic_uint head, tail;
+	uint32_t size;
+	uint32_t pad;
+	char data[];
+} Ring;
+
+typedef struct {
+	int fd;
+	char buf[4096];
+	uint32_t len;
+	bool overflow;
+	uint64_t last_active;
+
+	char *batch;
+	uint32_t batch_l, batch_c;
+	bool batching, batch_dropped;
+
+	char *out;
+	uint32_t out_l, out_c;
+	bool subscribed, dead;
+
+	Ring *ring;
+	int ring_efd;
+	uint32_t ring_tail;
+
+	struct wl_list link;
+} Client;
+
+/* Built-in status sources, expanded from ^name(argument) in status_format */
+enum { ModText, ModClock, ModCpu, ModMem, ModLoad, ModBat,
+       ModFile, ModNet, ModBacklight, ModExec };
+
+/* Modules with a period are polled on the shared timer, the others are
+ * only updated when their event source reports a change */
+typedef struct {
+	uint32_t type;
+	char *arg;
+	int fd, fd2; /* fd2 is a persistent block's stdin */
+	uint32_t period;
+	time_t due;
+	char text[256];
+	uint64_t cpu_total, cpu_idle;
+	uint64_t max_brightness;
+	int wd;
+	/* Exec blocks, a zero period keeps the command running */
+	char *cmd, **argv;
+	pid_t pid;
+	char line[256];
+	uint32_t line_l;
+	char click[128];
+	bool output, rerun, refresh;
+	uint64_t started, restart_at;
+	uint32_t backoff;
+	uint32_t start, end; /* offsets in the expanded status */
+} Module;
+
+/* Called with the epoll events of a registered fd */
+typedef void (*EventHandler)(void *data, uint32_t events);
+
+typedef struct {
+	EventHandler handler;
+	void *data;
+	uint32_t gen;
+} EventSource;
+
+typedef struct {
+	char name[16];
+	int fd;
+	bool no_dgram;
+	Ring *ring;
+	int ring_efd;
+	size_t ring_mapsize;
+} Target;
+
+typedef struct Seat {
 	struct wl_seat *wl_seat;
 	struct wl_pointer *wl_pointer;
 	uint32_t registry_name;
 
 	Bar *bar;
+	uint32_t enter_serial;
 	uint32_t pointer_x, pointer_y;
 	uint32_t pointer_button;
 
 	struct wl_list link;
+	struct Seat *id_next;
 } Seat;
 
-static int sock_fd;
+static int sock_fd, dgram_fd = -1;
 static char socketdir[256];
-static char *socketpath;
+static char registrypath[272];
+static char instance_name[16];
 static char sockbuf[4096];
 
-static char *stdinbuf;
-static size_t stdinbuf_cap;
+/* Parsed status and title of each cache entry */
+static Cache *cache;
+static CustomText *cached[CACHE_ENTRIES][2];
+static uint64_t cache_stamp;
+static bool cache_mapped;
+
+/* Holds at most one partial line between reads */
+static char stdinbuf[STDIN_BUF_MAX];
+static size_t stdinbuf_l;
+static bool stdin_overflow;
 
 static struct wl_display *display;
 static struct wl_compositor *compositor;
@@ -193,33 +406,41 @@ static struct zwlr_layer_shell_v1 *layer_shell;
 static struct zxdg_output_manager_v1 *output_manager;
 
 static struct zdwl_ipc_manager_v2 *dwl_wm;
-static struct wl_cursor_image *cursor_image;
-static struct wl_surface *cursor_surface;
+static struct zwlr_output_power_manager_v1 *power_manager;
 
-static struct wl_list bar_list, seat_list;
+static struct wl_list bar_list, seat_list, client_list, scale_list;
+
+/* Bars by output name and by registry name, seats by registry name.
+ * Collisions are chained through the objects themselves. */
+static Bar *bars_by_name[INDEX_SIZE], *bars_by_id[INDEX_SIZE];
+static Seat *seats_by_id[INDEX_SIZE];
+static Bar *selbar;
+static uint32_t clients_l, subscribers_l;
 
 static char **tags;
 static uint32_t tags_l, tags_c;
 static char **layouts;
 static uint32_t layouts_l, layouts_c;
 
-static struct fcft_font *font;
-static uint32_t height, textpadding, buffer_scale;
+static Module *modules;
+static uint32_t modules_l, modules_c;
+static int timer_fd = -1, inotify_fd = -1, rtnl_fd = -1, uevent_fd = -1;
+static uint32_t module_interval;
+static CustomText *module_status;
 
-static bool run_display;
+static int epoll_fd = -1, signal_fd = -1;
 
-#include "config.h"
+static Queue render_queue, done_queue;
+static int render_efd = -1, done_efd = -1;
+static atomic_bool render_stop;
+static pthread_t render_tid;
+static EventSource *sources; /* indexed by fd */
+static uint32_t sources_c, sources_gen;
 
-static void
-wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
-{
-	/* Sent by the compositor when it's no longer using this buffer */
-	wl_buffer_destroy(wl_buffer);
-}
 
-static const struct wl_buffer_listener wl_buffer_listener = {
-	.release = wl_buffer_release,
-};
+static bool run_display;
+
+#include "config.h"
 
 /* Shared memory support function adapted from [wayland-book] */
 static int
@@ -239,8 +460,201 @@ allocate_shm_file(size_t size)
 	return fd;
 }
 
+/* FNV-1a */
+static uint32_t
+hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; name++)
+		hash = (hash ^ (uint8_t)*name) * 16777619u;
+	return hash % INDEX_SIZE;
+}
+
+/* A bar is named before it is set up, but only addressed after */
+static Bar *
+find_bar(const char *name)
+{
+	for (Bar *bar = bars_by_name[hash_name(name)]; bar; bar = bar->name_next)
+		if (!strcmp(bar->output_name, name))
+			return bar->scale ? bar : NULL;
+	return NULL;
+}
+
+static Bar *
+find_bar_by_id(uint32_t registry_name)
+{
+	for (Bar *bar = bars_by_id[registry_name % INDEX_SIZE]; bar; bar = bar->id_next)
+		if (bar->registry_name == registry_name)
+			return bar;
+	return NULL;
+}
+
+static void
+unindex_bar_name(Bar *bar)
+{
+	if (!bar->output_name)
+		return;
+	Bar **p = &bars_by_name[hash_name(bar->output_name)];
+	while (*p != bar)
+		p = &(*p)->name_next;
+	*p = bar->name_next;
+}
+
+static void
+set_sel(Bar *bar, uint32_t sel)
+{
+	bar->sel = sel;
+	if (sel)
+		selbar = bar;
+	else if (selbar == bar)
+		selbar = NULL;
+}
+
+static void
+customtext_unref(CustomText *ct)
+{
+	if (!ct || --ct->refs)
+		return;
+	free(ct->colors);
+	free(ct->buttons);
+	free(ct);
+}
+
+/* Point a bar's status or title at ct, dropping the reference it held */
+static void
+set_customtext(CustomText **slot, CustomText *ct)
+{
+	if (ct)
+		ct->refs++;
+	customtext_unref(*slot);
+	*slot = ct;
+}
+
+/* Entry for an output name. Creating one takes a free entry or else the
+ * one updated longest ago. */
+static CacheEntry *
+cache_entry(const char *name, bool create)
+{
+	CacheEntry *oldest = &cache->entries[0];
+	for (uint32_t i = 0; i < CACHE_ENTRIES; i++) {
+		CacheEntry *entry = &cache->entries[i];
+		if (entry->stamp && !strcmp(entry->name, name))
+			return entry;
+		if (entry->stamp < oldest->stamp)
+			oldest = entry;
+	}
+	if (!create)
+		return NULL;
+
+	uint32_t i = oldest - cache->entries;
+	set_customtext(&cached[i][0], NULL);
+	set_customtext(&cached[i][1], NULL);
+	snprintf(oldest->name, sizeof oldest->name, "%s", name);
+	*oldest->status = *oldest->title = '\0';
+	return oldest;
+}
+
+/* Show what the bar's output showed last, if it was here before */
+static void
+cache_restore(Bar *bar)
+{
+	CacheEntry *entry;
+	if (!cache || !(entry = cache_entry(bar->output_name, false)))
+		return;
+
+	uint32_t i = entry - cache->entries;
+	if (cached[i][0] && !status_format) {
+		set_customtext(&bar->status, cached[i][0]);
+		bar->dirty |= DirtyStatus;
+	}
+	if (cached[i][1] && custom_title) {
+		set_customtext(&bar->title, cached[i][1]);
+		bar->dirty |= DirtyTitle;
+	}
+}
+
+static void
+cache_store(Bar *bar, bool title, CustomText *ct, const char *text)
+{
+	if (!cache || !bar->output_name)
+		return;
+
+	CacheEntry *entry = cache_entry(bar->output_name, true);
+	set_customtext(&cached[entry - cache->entries][title], ct);
+	if (cache_mapped)
+		snprintf(title ? entry->title : entry->status, TEXT_MAX, "%s", text);
+	entry->stamp = ++cache_stamp;
+}
+
+/* Single producer, single consumer. The producer owns head and the
+ * consumer owns tail; each only reads the other's index. */
+static bool
+queue_push(Queue *queue, Frame *frame)
+{
+	uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == QUEUE_SIZE)
+		return false;
+	queue->items[head % QUEUE_SIZE] = frame;
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
+
+static Frame *
+queue_pop(Queue *queue)
+{
+	uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&queue->head, memory_order_acquire))
+		return NULL;
+	Frame *frame = queue->items[tail % QUEUE_SIZE];
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return frame;
+}
+
+/* Frames are created and freed on the main thread, so CustomText and
+ * font references never change hands between threads */
+static void
+free_frame(Frame *frame)
+{
+	customtext_unref(frame->title);
+	customtext_unref(frame->status);
+	fcft_destroy(frame->font);
+	if (frame->fd != -1)
+		close(frame->fd);
+	free(frame);
+}
+
+/* Occupied, active and urgent bits of one tag, as 1 << TagOccupied etc. */
+static uint32_t
+tag_state(const uint64_t *bits, uint32_t words, uint32_t tag)
+{
+	const uint32_t w = tag / 64, b = tag % 64;
+	return (TAGSET(bits, words, TagOccupied)[w] >> b & 1) << TagOccupied
+		| (TAGSET(bits, words, TagActive)[w] >> b & 1) << TagActive
+		| (TAGSET(bits, words, TagUrgent)[w] >> b & 1) << TagUrgent;
+}
+
+/* First tag from i on that is shown, n if there is none. With
+ * hide_vacant, vacant tags are skipped a word at a time. */
+static uint32_t
+next_tag(const uint64_t *bits, uint32_t words, uint32_t n, uint32_t i)
+{
+	if (!hide_vacant || i >= n)
+		return i;
+	for (uint32_t w = i / 64; w < words; w++) {
+		uint64_t shown = TAGSET(bits, words, TagOccupied)[w]
+			| TAGSET(bits, words, TagActive)[w]
+			| TAGSET(bits, words, TagUrgent)[w];
+		if (w == i / 64)
+			shown &= ~(uint64_t)0 << i % 64;
+		if (shown)
+			return MIN(w * 64 + __builtin_ctzll(shown), n);
+	}
+	return n;
+}
+
 static uint32_t
-draw_text(char *text,
+draw_text(struct fcft_font *font,
+	  char *text,
 	  uint32_t x,
 	  uint32_t y,
 	  pixman_image_t *foreground,
@@ -363,53 +777,79 @@ draw_text(char *text,
 	return nx;
 }
 
-#define TEXT_WIDTH(text, maxwidth, padding)				\
-	draw_text(text, 0, 0, NULL, NULL, NULL, NULL, NULL, maxwidth, 0, padding, NULL, 0)
+#define TEXT_WIDTH(font, text, maxwidth, padding)			\
+	draw_text(font, text, 0, 0, NULL, NULL, NULL, NULL, NULL, maxwidth, 0, padding, NULL, 0)
 
-static int
-draw_frame(Bar *bar)
+/* Pen position after the first n bytes of text, advanced as in draw_text */
+static uint32_t
+text_offset_x(struct fcft_font *font, const char *text, uint32_t n)
+{
+	uint32_t x = 0, codepoint, state = UTF8_ACCEPT, last_cp = 0;
+	for (uint32_t i = 0; i < n && text[i]; i++) {
+		if (utf8decode(&state, &codepoint, text[i]))
+			continue;
+		const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
+		if (!glyph)
+			continue;
+		long kern = 0;
+		if (last_cp)
+			fcft_kerning(font, last_cp, codepoint, &kern, NULL);
+		last_cp = codepoint;
+		x += kern + glyph->advance.x;
+	}
+	return x;
+}
+
+/* Runs on the render thread and only touches the snapshot, its font and
+ * configuration that is fixed at startup */
+static void
+render_frame(Frame *frame)
 {
-	/* Allocate buffer to be attached to the surface */
-        int fd = allocate_shm_file(bar->bufsize);
+	/* Rasterize into shared memory that becomes the wl_buffer */
+	int fd = allocate_shm_file(frame->bufsize);
 	if (fd == -1)
-		return -1;
+		return;
 
-	uint32_t *data = mmap(NULL, bar->bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	uint32_t *data = mmap(NULL, frame->bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (data == MAP_FAILED) {
 		close(fd);
-		return -1;
+		return;
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, bar->bufsize);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, bar->width, bar->height, bar->stride, WL_SHM_FORMAT_ARGB8888);
-	wl_buffer_add_listener(buffer, &wl_buffer_listener, NULL);
-	wl_shm_pool_destroy(pool);
-	close(fd);
-
 	/* Pixman image corresponding to main buffer */
-	pixman_image_t *final = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, data, bar->width * 4);
+	pixman_image_t *final = pixman_image_create_bits(PIXMAN_a8r8g8b8, frame->width, frame->height, data, frame->width * 4);
 	
 	/* Text background and foreground layers */
-	pixman_image_t *foreground = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, NULL, bar->width * 4);
-	pixman_image_t *foreground_mask = pixman_image_create_bits(PIXMAN_a8, bar->width, bar->height, NULL, bar->width * 4);
-	pixman_image_t *background = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, NULL, bar->width * 4);
+	pixman_image_t *foreground = pixman_image_create_bits(PIXMAN_a8r8g8b8, frame->width, frame->height, NULL, frame->width * 4);
+	pixman_image_t *foreground_mask = pixman_image_create_bits(PIXMAN_a8, frame->width, frame->height, NULL, frame->width * 4);
+	pixman_image_t *background = pixman_image_create_bits(PIXMAN_a8r8g8b8, frame->width, frame->height, NULL, frame->width * 4);
 	
 	/* Draw on images */
 	uint32_t x = 0;
-	uint32_t y = (bar->height + font->ascent - font->descent) / 2;
+	struct fcft_font *font = frame->font;
+	uint32_t y = (frame->height + font->ascent - font->descent) / 2;
 	uint32_t boxs = font->height / 9;
 	uint32_t boxw = font->height / 6 + 2;
 
-	for (uint32_t i = 0; i < tags_l; i++) {
-		const bool active = bar->mtags & 1 << i;
-		const bool occupied = bar->ctags & 1 << i;
-		const bool urgent = bar->urg & 1 << i;
-		
-		if (hide_vacant && !active && !occupied && !urgent)
-			continue;
-
-		pixman_color_t *fg_color = urgent ? &urgent_fg_color : (active ? &active_fg_color : (occupied ? &occupied_fg_color : &inactive_fg_color));
-		pixman_color_t *bg_color = urgent ? &urgent_bg_color : (active ? &active_bg_color : (occupied ? &occupied_bg_color : &inactive_bg_color));
+	/* Tag colors by tag_state(): urgent over active over occupied */
+	pixman_color_t *const tag_fg[8] = {
+		&inactive_fg_color, &occupied_fg_color, &active_fg_color, &active_fg_color,
+		&urgent_fg_color, &urgent_fg_color, &urgent_fg_color, &urgent_fg_color
+	};
+	pixman_color_t *const tag_bg[8] = {
+		&inactive_bg_color, &occupied_bg_color, &active_bg_color, &active_bg_color,
+		&urgent_bg_color, &urgent_bg_color, &urgent_bg_color, &urgent_bg_color
+	};
+
+	const uint64_t *bits = frame->tagbits;
+	for (uint32_t i = next_tag(bits, frame->tagwords, frame->tags_l, 0); i < frame->tags_l;
+	     i = next_tag(bits, frame->tagwords, frame->tags_l, i + 1)) {
+		const uint32_t state = tag_state(bits, frame->tagwords, i);
+		const bool active = state & 1 << TagActive;
+		const bool occupied = state & 1 << TagOccupied;
+
+		pixman_color_t *fg_color = tag_fg[state];
+		pixman_color_t *bg_color = tag_bg[state];
 		
 		if (!hide_vacant && occupied) {
 			pixman_image_fill_boxes(PIXMAN_OP_SRC, foreground,
@@ -423,7 +863,7 @@ draw_frame(Bar *bar)
 							.x1 = x + boxs, .x2 = x + boxs + boxw,
 							.y1 = boxs, .y2 = boxs + boxw
 						});
-			if ((!bar->sel || !active) && boxw >= 3) {
+			if ((!frame->sel || !active) && boxw >= 3) {
 				/* Make box hollow */
 				pixman_image_fill_boxes(PIXMAN_OP_SRC, foreground,
 							&(pixman_color_t){ 0 },
@@ -440,68 +880,210 @@ draw_frame(Bar *bar)
 			}
 		}
 		
-		x = draw_text(tags[i], x, y, foreground, foreground_mask, background, fg_color, bg_color,
-			      bar->width, bar->height, bar->textpadding, NULL, 0);
+		x = draw_text(font, frame->tags[i], x, y, foreground, foreground_mask, background, fg_color, bg_color,
+			      frame->width, frame->height, frame->textpadding, NULL, 0);
 	}
+	frame->bounds[0] = x;
 	
-	x = draw_text(bar->layout, x, y, foreground, foreground_mask, background,
-		      &inactive_fg_color, &inactive_bg_color, bar->width,
-		      bar->height, bar->textpadding, NULL, 0);
+	x = draw_text(font, frame->layout, x, y, foreground, foreground_mask, background,
+		      &inactive_fg_color, &inactive_bg_color, frame->width,
+		      frame->height, frame->textpadding, NULL, 0);
+	frame->bounds[1] = x;
 	
-	uint32_t status_width = TEXT_WIDTH(bar->status.text, bar->width - x, bar->textpadding);
-	draw_text(bar->status.text, bar->width - status_width, y, foreground, foreground_mask,
-		  background, &inactive_fg_color, &inactive_bg_color,
-		  bar->width, bar->height, bar->textpadding,
-		  bar->status.colors, bar->status.colors_l);
+	CustomText *status = frame->status, *title = custom_title ? frame->title : NULL;
+	char *title_text = custom_title ? (title ? title->text : NULL) : frame->window_title;
+
+	uint32_t status_width = 0;
+	if (status) {
+		status_width = TEXT_WIDTH(font, status->text, frame->width - x, frame->textpadding);
+		draw_text(font, status->text, frame->width - status_width, y, foreground, foreground_mask,
+			  background, &inactive_fg_color, &inactive_bg_color,
+			  frame->width, frame->height, frame->textpadding,
+			  status->colors, status->colors_l);
+	}
+	frame->bounds[2] = frame->width - status_width;
 
 	uint32_t nx;
 	if (center_title) {
-		uint32_t title_width = TEXT_WIDTH(custom_title ? bar->title.text : bar->window_title, bar->width - status_width - x, 0);
-		nx = MAX(x, MIN((bar->width - title_width) / 2, bar->width - status_width - title_width));
+		uint32_t title_width = TEXT_WIDTH(font, title_text, frame->width - status_width - x, 0);
+		nx = MAX(x, MIN((frame->width - title_width) / 2, frame->width - status_width - title_width));
 	} else {
-		nx = MIN(x + bar->textpadding, bar->width - status_width);
+		nx = MIN(x + frame->textpadding, frame->width - status_width);
 	}
 	pixman_image_fill_boxes(PIXMAN_OP_SRC, background,
-				bar->sel ? &middle_bg_color_selected : &middle_bg_color, 1,
+				frame->sel ? &middle_bg_color_selected : &middle_bg_color, 1,
 				&(pixman_box32_t){
 					.x1 = x, .x2 = nx,
-					.y1 = 0, .y2 = bar->height
+					.y1 = 0, .y2 = frame->height
 				});
 	x = nx;
 	
-	x = draw_text(custom_title ? bar->title.text : bar->window_title,
+	x = draw_text(font, title_text,
 		      x, y, foreground, foreground_mask, background,
-		      (bar->sel && active_color_title) ? &active_fg_color : &inactive_fg_color,
-		      (bar->sel && active_color_title) ? &active_bg_color : &inactive_bg_color,
-		      bar->width - status_width, bar->height, 0,
-		      custom_title ? bar->title.colors : NULL,
-		      custom_title ? bar->title.colors_l : 0);
+		      (frame->sel && active_color_title) ? &active_fg_color : &inactive_fg_color,
+		      (frame->sel && active_color_title) ? &active_bg_color : &inactive_bg_color,
+		      frame->width - status_width, frame->height, 0,
+		      title ? title->colors : NULL,
+		      title ? title->colors_l : 0);
 
 	pixman_image_fill_boxes(PIXMAN_OP_SRC, background,
-				bar->sel ? &middle_bg_color_selected : &middle_bg_color, 1,
+				frame->sel ? &middle_bg_color_selected : &middle_bg_color, 1,
 				&(pixman_box32_t){
-					.x1 = x, .x2 = bar->width - status_width,
-					.y1 = 0, .y2 = bar->height
+					.x1 = x, .x2 = frame->width - status_width,
+					.y1 = 0, .y2 = frame->height
 				});
 
 	/* Draw background and foreground on bar */
-	pixman_image_composite32(PIXMAN_OP_OVER, background, NULL, final, 0, 0, 0, 0, 0, 0, bar->width, bar->height);
+	pixman_image_composite32(PIXMAN_OP_OVER, background, NULL, final, 0, 0, 0, 0, 0, 0, frame->width, frame->height);
 	pixman_image_set_alpha_map(foreground, foreground_mask, 0, 0);
-	pixman_image_composite32(PIXMAN_OP_OVER, foreground, foreground_mask, final, 0, 0, 0, 0, 0, 0, bar->width, bar->height);
+	pixman_image_composite32(PIXMAN_OP_OVER, foreground, foreground_mask, final, 0, 0, 0, 0, 0, 0, frame->width, frame->height);
 
 	pixman_image_unref(foreground);
 	pixman_image_unref(foreground_mask);
 	pixman_image_unref(background);
 	pixman_image_unref(final);
 	
-	munmap(data, bar->bufsize);
+	munmap(data, frame->bufsize);
+	frame->fd = fd;
+}
 
-	wl_surface_set_buffer_scale(bar->wl_surface, buffer_scale);
-	wl_surface_attach(bar->wl_surface, buffer, 0, 0);
-	wl_surface_damage_buffer(bar->wl_surface, 0, 0, bar->width, bar->height);
-	wl_surface_commit(bar->wl_surface);
+/* Hand a snapshot of the bar to the render thread. Only one frame per bar
+ * is in flight, later changes stay dirty until it is back. */
+static void
+draw_frame(Bar *bar)
+{
+	if (bar->rendering)
+		return;
 
-	return 0;
+	/* Tags without state, should dwl announce more than there is room
+	 * for yet, are left out */
+	const uint32_t words = bar->tagbits.words;
+	const uint32_t tags_n = MIN(tags_l, words * 64);
+	size_t size = sizeof(Frame) + TagSets * words * sizeof(uint64_t) + tags_n * sizeof(char *);
+	for (uint32_t i = 0; i < tags_n; i++)
+		size += strlen(tags[i]) + 1;
+	size += (bar->layout ? strlen(bar->layout) + 1 : 0)
+		+ (bar->window_title ? strlen(bar->window_title) + 1 : 0);
+
+	/* Tag bits, tag pointers and strings follow in the same allocation */
+	Frame *frame = calloc(1, size);
+	if (!frame)
+		return;
+	if (words)
+		memcpy(frame->tagbits, bar->tagbits.bits, TagSets * words * sizeof(uint64_t));
+	frame->tags = (char **)(frame->tagbits + TagSets * words);
+	char *p = (char *)(frame->tags + tags_n);
+	for (uint32_t i = 0; i < tags_n; i++)
+		p = stpcpy(frame->tags[i] = p, tags[i]) + 1;
+	if (bar->layout)
+		p = stpcpy(frame->layout = p, bar->layout) + 1;
+	if (bar->window_title)
+		stpcpy(frame->window_title = p, bar->window_title);
+
+	frame->registry_name = bar->registry_name;
+	frame->width = bar->width;
+	frame->height = bar->height;
+	frame->stride = bar->stride;
+	frame->bufsize = bar->bufsize;
+	frame->font = fcft_clone(bar->scale->font);
+	frame->textpadding = bar->textpadding;
+	frame->tags_l = tags_n;
+	frame->tagwords = words;
+	frame->sel = bar->sel;
+	set_customtext(&frame->title, bar->title);
+	set_customtext(&frame->status, bar->status);
+	frame->dirty = bar->dirty;
+	frame->fd = -1;
+
+	if (!queue_push(&render_queue, frame)) {
+		free_frame(frame);
+		return;
+	}
+	bar->dirty = 0;
+	bar->rendering = true;
+	eventfd_write(render_efd, 1);
+}
+
+static void *
+render_thread(void *data)
+{
+	Frame *frame;
+	eventfd_t count;
+
+	while (!atomic_load(&render_stop)) {
+		if (!(frame = queue_pop(&render_queue))) {
+			eventfd_read(render_efd, &count);
+			continue;
+		}
+		render_frame(frame);
+		queue_push(&done_queue, frame);
+		eventfd_write(done_efd, 1);
+	}
+	return NULL;
+}
+
+/* Attach frames coming back from the render thread. Frames for a bar that
+ * went away, was hidden or changed size in the meantime are dropped. */
+static void
+read_frames(void *data, uint32_t events)
+{
+	Frame *frame;
+	eventfd_t count;
+
+	eventfd_read(done_efd, &count);
+	while ((frame = queue_pop(&done_queue))) {
+		Bar *bar = find_bar_by_id(frame->registry_name);
+		if (!bar) {
+			free_frame(frame);
+			continue;
+		}
+		bar->rendering = false;
+		bar->render_failed = frame->fd == -1;
+		if (frame->fd == -1 || bar->hidden || bar->fullscreen || bar->powered_off || !bar->configured
+		    || frame->width != bar->width || frame->height != bar->height) {
+			/* Whatever this frame covered has to be drawn again */
+			bar->dirty |= DirtyAll;
+			bar->drawn = false;
+			free_frame(frame);
+			continue;
+		}
+
+		struct wl_shm_pool *pool = wl_shm_create_pool(shm, frame->fd, frame->bufsize);
+		struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, frame->width, frame->height,
+								     frame->stride, WL_SHM_FORMAT_ARGB8888);
+		wl_shm_pool_destroy(pool);
+
+		/* Damage the dirty regions and any region that moved, in their
+		 * old and new place */
+		uint32_t x1 = 0, x2 = frame->width;
+		if (bar->drawn) {
+			x1 = frame->width;
+			x2 = 0;
+			for (uint32_t i = 0; i < 4; i++) {
+				uint32_t o1 = i ? bar->bounds[i - 1] : 0, o2 = i < 3 ? bar->bounds[i] : frame->width;
+				uint32_t n1 = i ? frame->bounds[i - 1] : 0, n2 = i < 3 ? frame->bounds[i] : frame->width;
+				if ((frame->dirty & 1 << i) || o1 != n1 || o2 != n2) {
+					x1 = MIN(x1, MIN(o1, n1));
+					x2 = MAX(x2, MAX(o2, n2));
+				}
+			}
+		}
+		memcpy(bar->bounds, frame->bounds, sizeof bar->bounds);
+		bar->drawn = true;
+
+		/* The old buffer's memory is never written again, so it can go
+		 * before the compositor releases it */
+		if (bar->buffer)
+			wl_buffer_destroy(bar->buffer);
+		bar->buffer = buffer;
+
+		wl_surface_set_buffer_scale(bar->wl_surface, bar->scale->scale);
+		wl_surface_attach(bar->wl_surface, buffer, 0, 0);
+		if (x2 > x1)
+			wl_surface_damage_buffer(bar->wl_surface, x1, 0, x2 - x1, bar->height);
+		wl_surface_commit(bar->wl_surface);
+		free_frame(frame);
+	}
 }
 
 /* Layer-surface setup adapted from layer-shell example in [wlroots] */
@@ -509,23 +1091,32 @@ static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 			uint32_t serial, uint32_t w, uint32_t h)
 {
-	w = w * buffer_scale;
-	h = h * buffer_scale;
+	Bar *bar = (Bar *)data;
+
+	w = w * bar->scale->scale;
+	h = h * bar->scale->scale;
 
 	zwlr_layer_surface_v1_ack_configure(surface, serial);
 	
-	Bar *bar = (Bar *)data;
-	
-	if (bar->configured && w == bar->width && h == bar->height)
+	if (w == bar->width && h == bar->height && (bar->configured || bar->buffer)) {
+		if (!bar->configured) {
+			/* Mapped again after hide_bar(), put the last frame back */
+			wl_surface_set_buffer_scale(bar->wl_surface, bar->scale->scale);
+			wl_surface_attach(bar->wl_surface, bar->buffer, 0, 0);
+			wl_surface_damage_buffer(bar->wl_surface, 0, 0, bar->width, bar->height);
+			wl_surface_commit(bar->wl_surface);
+		}
+		bar->configured = true;
 		return;
+	}
 	
 	bar->width = w;
 	bar->height = h;
 	bar->stride = bar->width * 4;
 	bar->bufsize = bar->stride * bar->height;
 	bar->configured = true;
-
-	draw_frame(bar);
+	bar->drawn = false;
+	bar->dirty |= DirtyAll;
 }
 
 static void
@@ -538,195 +1129,517 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.closed = layer_surface_closed,
 };
 
-static void
-cleanup(void)
+/* Sockets live in the abstract namespace, named after a path in socketdir,
+ * so a crashed instance leaves nothing behind */
+static socklen_t
+abstract_address(struct sockaddr_un *addr, const char *name, const char *suffix)
 {
-	if (socketpath)
-		unlink(socketpath);
+	int n = snprintf(addr->sun_path + 1, sizeof addr->sun_path - 1, "%s/%s%s", socketdir, name, suffix);
+	addr->sun_family = AF_UNIX;
+	addr->sun_path[0] = '\0';
+	return offsetof(struct sockaddr_un, sun_path) + 1 + MIN((size_t)n, sizeof addr->sun_path - 2);
 }
 
-static void
-output_name(void *data, struct zxdg_output_v1 *xdg_output, const char *name)
+/* Datagram peers cannot be asked for their credentials, so datagram
+ * sockets are bound in socketdir where only our user can create them */
+static socklen_t
+socket_path(struct sockaddr_un *addr, const char *name, const char *suffix)
 {
-	Bar *bar = (Bar *)data;
-	
-	if (bar->xdg_output_name)
-		free(bar->xdg_output_name);
-	if (!(bar->xdg_output_name = strdup(name)))
-		EDIE("strdup");
+	int n = snprintf(addr->sun_path, sizeof addr->sun_path, "%s/%s%s", socketdir, name, suffix);
+	addr->sun_family = AF_UNIX;
+	return offsetof(struct sockaddr_un, sun_path) + MIN((size_t)n, sizeof addr->sun_path - 1) + 1;
 }
 
+/* The registry lists one 'NAME PID' line per running instance. It is
+ * rewritten under an exclusive lock, pruning instances whose process is
+ * gone and adding or removing our own entry. */
 static void
-output_logical_position(void *data, struct zxdg_output_v1 *xdg_output,
-			int32_t x, int32_t y)
+update_registry(bool add)
 {
+	char buf[4096], out[4096];
+	size_t out_l = 0;
+
+	int fd = open(registrypath, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return;
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return;
+	}
+
+	ssize_t len = read(fd, buf, sizeof buf - 1);
+	buf[MAX(len, 0)] = '\0';
+
+	char name[16];
+	int pid, n;
+	for (char *p = buf; sscanf(p, "%15s %d\n%n", name, &pid, &n) == 2; p += n) {
+		/* EPERM means the pid now belongs to another user */
+		if (!strcmp(name, instance_name) || kill(pid, 0) == -1)
+			continue;
+		out_l += snprintf(out + out_l, sizeof out - out_l, "%s %d\n", name, pid);
+		out_l = MIN(out_l, sizeof out - 1);
+	}
+	if (add) {
+		out_l += snprintf(out + out_l, sizeof out - out_l, "%s %d\n", instance_name, getpid());
+		out_l = MIN(out_l, sizeof out - 1);
+	}
+
+	if (pwrite(fd, out, out_l, 0) == -1 || ftruncate(fd, out_l) == -1)
+		fprintf(stderr, "Could not update '%s': %s\n", registrypath, strerror(errno));
+	close(fd);
 }
 
 static void
-output_logical_size(void *data, struct zxdg_output_v1 *xdg_output,
-		    int32_t width, int32_t height)
+cleanup(void)
 {
+	if (*instance_name)
+		update_registry(false);
 }
 
 static void
-output_done(void *data, struct zxdg_output_v1 *xdg_output)
+set_output_name(Bar *bar, const char *name)
+{
+	unindex_bar_name(bar);
+	if (bar->output_name)
+		free(bar->output_name);
+	if (!(bar->output_name = strdup(name)))
+		EDIE("strdup");
+	uint32_t hash = hash_name(name);
+	bar->name_next = bars_by_name[hash];
+	bars_by_name[hash] = bar;
+	cache_restore(bar);
+}
+
+static Scale *
+get_scale(uint32_t factor)
 {
+	Scale *scale;
+	wl_list_for_each(scale, &scale_list, link)
+		if (scale->scale == factor)
+			return scale;
+
+	if (!(scale = calloc(1, sizeof(Scale))))
+		EDIE("calloc");
+	char dpi[16];
+	snprintf(dpi, sizeof dpi, "dpi=%u", 96 * factor);
+	if (!(scale->font = fcft_from_name(1, (const char *[]) {fontstr}, dpi)))
+		DIE("Could not load font");
+	scale->scale = factor;
+	scale->textpadding = scale->font->height / 2;
+	scale->height = scale->font->height / factor + vertical_padding * 2;
+	wl_list_insert(&scale_list, &scale->link);
+	return scale;
 }
 
+/* Show the cursor of the scale of the bar under the pointer, loading it
+ * on first use */
 static void
-output_description(void *data, struct zxdg_output_v1 *xdg_output,
-		   const char *description)
+set_cursor(Seat *seat)
 {
+	Scale *scale = seat->bar->scale;
+	if (!scale->cursor_image) {
+		const char *size_str = getenv("XCURSOR_SIZE");
+		int size = size_str ? atoi(size_str) : 0;
+		if (size == 0)
+			size = 24;
+		scale->cursor_theme = wl_cursor_theme_load(getenv("XCURSOR_THEME"), size * scale->scale, shm);
+		scale->cursor_image = wl_cursor_theme_get_cursor(scale->cursor_theme, "left_ptr")->images[0];
+		scale->cursor_surface = wl_compositor_create_surface(compositor);
+		wl_surface_set_buffer_scale(scale->cursor_surface, scale->scale);
+		wl_surface_attach(scale->cursor_surface, wl_cursor_image_get_buffer(scale->cursor_image), 0, 0);
+		wl_surface_commit(scale->cursor_surface);
+	}
+	wl_pointer_set_cursor(seat->wl_pointer, seat->enter_serial, scale->cursor_surface,
+			      scale->cursor_image->hotspot_x / scale->scale,
+			      scale->cursor_image->hotspot_y / scale->scale);
 }
 
-static const struct zxdg_output_v1_listener output_listener = {
-	.name = output_name,
-	.logical_position = output_logical_position,
-	.logical_size = output_logical_size,
-	.done = output_done,
-	.description = output_description
-};
-
+/* Free a scale once no bar uses it. Frames in flight hold their own
+ * reference to the font, and seats have moved on to another cursor. */
 static void
-shell_command(char *command)
+release_scale(Scale *scale)
 {
-	if (fork() == 0) {
-		setsid();
-		execl("/bin/sh", "sh", "-c", command, NULL);
-		exit(EXIT_SUCCESS);
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link)
+		if (bar->scale == scale)
+			return;
+
+	fcft_destroy(scale->font);
+	if (scale->cursor_theme) {
+		wl_surface_destroy(scale->cursor_surface);
+		wl_cursor_theme_destroy(scale->cursor_theme);
 	}
+	wl_list_remove(&scale->link);
+	free(scale);
 }
 
+/* Follow the output's scale, unless one is forced with -scale. A new
+ * size is committed here and the configure that follows redraws. */
 static void
-pointer_enter(void *data, struct wl_pointer *pointer,
-	      uint32_t serial, struct wl_surface *surface,
-	      wl_fixed_t surface_x, wl_fixed_t surface_y)
+update_scale(Bar *bar)
 {
-	Seat *seat = (Seat *)data;
+	const uint32_t factor = buffer_scale ? buffer_scale : (uint32_t)MAX(bar->output_scale, 1);
+	if (bar->scale && bar->scale->scale == factor)
+		return;
 
-	seat->bar = NULL;
-	Bar *bar;
-	wl_list_for_each(bar, &bar_list, link) {
-		if (bar->wl_surface == surface) {
-			seat->bar = bar;
-			break;
-		}
+	Scale *old = bar->scale;
+	bar->scale = get_scale(factor);
+	if (old) {
+		Seat *seat;
+		wl_list_for_each(seat, &seat_list, link)
+			if (seat->bar == bar)
+				set_cursor(seat);
+		release_scale(old);
 	}
-
-	if (!cursor_image) {
-		const char *size_str = getenv("XCURSOR_SIZE");
-		int size = size_str ? atoi(size_str) : 0;
-		if (size == 0)
-			size = 24;
-		struct wl_cursor_theme *cursor_theme = wl_cursor_theme_load(getenv("XCURSOR_THEME"), size * buffer_scale, shm);
-		cursor_image = wl_cursor_theme_get_cursor(cursor_theme, "left_ptr")->images[0];
-		cursor_surface = wl_compositor_create_surface(compositor);
-		wl_surface_set_buffer_scale(cursor_surface, buffer_scale);
-		wl_surface_attach(cursor_surface, wl_cursor_image_get_buffer(cursor_image), 0, 0);
-		wl_surface_commit(cursor_surface);
+	bar->height = bar->scale->height * factor;
+	bar->textpadding = bar->scale->textpadding;
+	if (bar->layer_surface && !bar->hidden) {
+		zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->scale->height);
+		zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface,
+							 bar->fullscreen && fullscreen_release_zone ? 0 : bar->scale->height);
+		wl_surface_commit(bar->wl_surface);
 	}
-	wl_pointer_set_cursor(pointer, serial, cursor_surface,
-			      cursor_image->hotspot_x,
-			      cursor_image->hotspot_y);
 }
 
+/* Older compositors only name outputs through xdg_output */
 static void
-pointer_leave(void *data, struct wl_pointer *pointer,
-	      uint32_t serial, struct wl_surface *surface)
+xdg_output_name(void *data, struct zxdg_output_v1 *xdg_output, const char *name)
 {
-	Seat *seat = (Seat *)data;
-	
-	seat->bar = NULL;
+	set_output_name((Bar *)data, name);
 }
 
 static void
-pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
-	       uint32_t time, uint32_t button, uint32_t state)
+xdg_output_logical_position(void *data, struct zxdg_output_v1 *xdg_output,
+			    int32_t x, int32_t y)
 {
-	Seat *seat = (Seat *)data;
+}
 
-	seat->pointer_button = state == WL_POINTER_BUTTON_STATE_PRESSED ? button : 0;
+static void
+xdg_output_logical_size(void *data, struct zxdg_output_v1 *xdg_output,
+			int32_t width, int32_t height)
+{
 }
 
 static void
-pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
-	       wl_fixed_t surface_x, wl_fixed_t surface_y)
+xdg_output_done(void *data, struct zxdg_output_v1 *xdg_output)
 {
-	Seat *seat = (Seat *)data;
-	
-	seat->pointer_x = wl_fixed_to_int(surface_x);
-	seat->pointer_y = wl_fixed_to_int(surface_y);
 }
 
 static void
-pointer_frame(void *data, struct wl_pointer *pointer)
+xdg_output_description(void *data, struct zxdg_output_v1 *xdg_output,
+		       const char *description)
 {
-	Seat *seat = (Seat *)data;
+}
 
-	if (!seat->pointer_button || !seat->bar)
-		return;
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+	.name = xdg_output_name,
+	.logical_position = xdg_output_logical_position,
+	.logical_size = xdg_output_logical_size,
+	.done = xdg_output_done,
+	.description = xdg_output_description
+};
 
-	uint32_t x = 0, i = 0;
-	do {
-		if (hide_vacant) {
-			const bool active = seat->bar->mtags & 1 << i;
-			const bool occupied = seat->bar->ctags & 1 << i;
-			const bool urgent = seat->bar->urg & 1 << i;
-			if (!active && !occupied && !urgent)
-				continue;
-		}
-		x += TEXT_WIDTH(tags[i], seat->bar->width - x, seat->bar->textpadding) / buffer_scale;
-	} while (seat->pointer_x >= x && ++i < tags_l);
+/* Watch fd for events, calling handler with data. Sources are kept in a
+ * table indexed by fd. Events carry the fd and the generation it was added
+ * with, so events of a source removed while handling a batch are skipped,
+ * even when its fd was reused in the meantime. */
+static int
+event_add(int fd, uint32_t events, EventHandler handler, void *data)
+{
+	if ((uint32_t)fd >= sources_c) {
+		uint32_t cap = MAX((uint32_t)fd + 1, sources_c * 2);
+		if (!(sources = realloc(sources, cap * sizeof(*sources))))
+			EDIE("realloc");
+		memset(sources + sources_c, 0, (cap - sources_c) * sizeof(*sources));
+		sources_c = cap;
+	}
 
-	if (i < tags_l) {
-		/* Clicked on tags */
-		if (ipc) {
+	uint32_t gen = ++sources_gen;
+	struct epoll_event ev = { .events = events, .data.u64 = (uint64_t)gen << 32 | (uint32_t)fd };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return -1;
+	sources[fd] = (EventSource){ handler, data, gen };
+	return 0;
+}
+
+static void
+event_modify(int fd, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = (uint64_t)sources[fd].gen << 32 | (uint32_t)fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Must be called before fd is closed */
+static void
+event_remove(int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	sources[fd] = (EventSource){ 0 };
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Commands without shell syntax are split on blanks so they can be run
+ * directly. Returns a single allocation, or NULL when a shell is needed. */
+static char **
+split_command(const char *command)
+{
+	if (strpbrk(command, "|&;<>()$`\\\"'*?[]{}~#=!\n"))
+		return NULL;
+
+	size_t len = strlen(command) + 1, argc = 0;
+	for (const char *p = command; *(p += strspn(p, " \t")); p += strcspn(p, " \t"))
+		argc++;
+	if (!argc)
+		return NULL;
+
+	char **argv = malloc((argc + 1) * sizeof(char *) + len);
+	if (!argv)
+		EDIE("malloc");
+	char *str = memcpy(argv + argc + 1, command, len), *save;
+	argc = 0;
+	for (char *tok = strtok_r(str, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
+	return argv;
+}
+
+/* Spawn command in its own session without copying our address space,
+ * through /bin/sh only when argv is NULL. Output goes to out_fd if set,
+ * input comes from in_fd if set and otherwise from /dev/null. */
+static pid_t
+spawn(char *command, char **argv, int in_fd, int out_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask, defaults;
+	char *sh_argv[] = { "sh", "-c", command, NULL };
+	pid_t pid;
+
+	sigemptyset(&mask);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	sigaddset(&defaults, SIGCHLD);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK
+				 | POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	else if (out_fd != -1)
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	if (out_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+	int err = argv ? posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ)
+		: posix_spawn(&pid, "/bin/sh", &actions, &attr, sh_argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (err) {
+		fprintf(stderr, "Could not run '%s': %s\n", command, strerror(err));
+		return -1;
+	}
+	return pid;
+}
+
+static void
+shell_command(char *command)
+{
+	char **argv = split_command(command);
+	spawn(command, argv, -1, -1);
+	free(argv);
+}
+
+static void
+stop_block(Module *module)
+{
+	if (module->pid)
+		kill(-module->pid, SIGTERM);
+	if (module->fd != -1) {
+		event_remove(module->fd);
+		close(module->fd);
+	}
+	if (module->fd2 != -1)
+		close(module->fd2);
+	module->fd = module->fd2 = -1;
+	module->pid = 0;
+}
+
+/* Exec blocks notice exits through their pipe, reaping only stops them
+ * from being signalled once their pid may be reused */
+static void
+reap_children(void)
+{
+	pid_t pid;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		for (uint32_t i = 0; i < modules_l; i++)
+			if (modules[i].type == ModExec && modules[i].pid == pid)
+				modules[i].pid = 0;
+}
+
+/* Buttons inside an exec block run through the block. A periodic block
+ * runs the handler in its place from expire_blocks, so its output lands
+ * there and the block is refreshed once it is done. A persistent block
+ * gets the command as a line on its stdin, like clicks in i3blocks. */
+static void
+status_button(Bar *bar, Button *button)
+{
+	if (bar->status == module_status) {
+		for (uint32_t i = 0; i < modules_l; i++) {
+			Module *module = &modules[i];
+			if (module->type != ModExec
+			    || button->src < module->start || button->src >= module->end)
+				continue;
+			if (module->period) {
+				stop_block(module);
+				snprintf(module->click, sizeof module->click, "%s", button->command);
+				return;
+			}
+			char line[sizeof module->click + 1];
+			int len = snprintf(line, sizeof line, "%.*s\n",
+					   (int)sizeof module->click - 1, button->command);
+			if (module->fd2 == -1 || write(module->fd2, line, len) != len)
+				fprintf(stderr, "Could not pass click to '%s'\n", module->cmd);
+			return;
+		}
+	}
+	shell_command(button->command);
+}
+
+static void
+pointer_enter(void *data, struct wl_pointer *pointer,
+	      uint32_t serial, struct wl_surface *surface,
+	      wl_fixed_t surface_x, wl_fixed_t surface_y)
+{
+	Seat *seat = (Seat *)data;
+
+	/* The surface is NULL if we destroyed it in the meantime */
+	seat->bar = surface ? wl_surface_get_user_data(surface) : NULL;
+
+	if (!seat->bar)
+		return;
+
+	seat->enter_serial = serial;
+	set_cursor(seat);
+}
+
+static void
+pointer_leave(void *data, struct wl_pointer *pointer,
+	      uint32_t serial, struct wl_surface *surface)
+{
+	Seat *seat = (Seat *)data;
+	
+	seat->bar = NULL;
+}
+
+static void
+pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+	       uint32_t time, uint32_t button, uint32_t state)
+{
+	Seat *seat = (Seat *)data;
+
+	seat->pointer_button = state == WL_POINTER_BUTTON_STATE_PRESSED ? button : 0;
+}
+
+static void
+pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+	       wl_fixed_t surface_x, wl_fixed_t surface_y)
+{
+	Seat *seat = (Seat *)data;
+	
+	seat->pointer_x = wl_fixed_to_int(surface_x);
+	seat->pointer_y = wl_fixed_to_int(surface_y);
+}
+
+/* Button of ct for btn under px, with the text drawn from x on */
+static Button *
+button_at(struct fcft_font *font, CustomText *ct, uint32_t btn, uint32_t x, uint32_t px)
+{
+	for (uint32_t i = 0; i < ct->buttons_l; i++) {
+		Button *button = &ct->buttons[i];
+		if (button->btn == btn
+		    && px >= x + text_offset_x(font, ct->text, button->start)
+		    && px < x + text_offset_x(font, ct->text, button->end))
+			return button;
+	}
+	return NULL;
+}
+
+/* Hit-testing is done in buffer pixels, laid out as in render_frame */
+static void
+pointer_frame(void *data, struct wl_pointer *pointer)
+{
+	Seat *seat = (Seat *)data;
+
+	if (!seat->pointer_button || !seat->bar)
+		return;
+
+	Bar *bar = seat->bar;
+	struct fcft_font *font = bar->scale->font;
+	const uint32_t px = seat->pointer_x * bar->scale->scale;
+	const uint64_t *bits = bar->tagbits.bits;
+	const uint32_t words = bar->tagbits.words;
+	const uint32_t n = MIN(tags_l, words * 64);
+	uint32_t x = 0, i;
+	for (i = next_tag(bits, words, n, 0); i < n; i = next_tag(bits, words, n, i + 1)) {
+		x += TEXT_WIDTH(font, tags[i], bar->width - x, bar->textpadding);
+		if (px < x)
+			break;
+	}
+
+	if (i < n) {
+		/* Clicked on tags. The protocol takes 32-bit masks, so tags
+		 * past the first 32 cannot be selected from here. */
+		if (ipc && i < 32) {
+			const uint32_t mtags = TAGSET(bits, words, TagActive)[0];
 			if (seat->pointer_button == BTN_LEFT)
-				zdwl_ipc_output_v2_set_tags(seat->bar->dwl_wm_output, 1 << i, 1);
+				zdwl_ipc_output_v2_set_tags(bar->dwl_wm_output, 1u << i, 1);
 			else if (seat->pointer_button == BTN_MIDDLE)
-				zdwl_ipc_output_v2_set_tags(seat->bar->dwl_wm_output, ~0, 1);
+				zdwl_ipc_output_v2_set_tags(bar->dwl_wm_output, ~0, 1);
 			else if (seat->pointer_button == BTN_RIGHT)
-				zdwl_ipc_output_v2_set_tags(seat->bar->dwl_wm_output, seat->bar->mtags ^ (1 << i), 0);
+				zdwl_ipc_output_v2_set_tags(bar->dwl_wm_output, mtags ^ (1u << i), 0);
 		}
-	} else if (seat->pointer_x < (x += TEXT_WIDTH(seat->bar->layout, seat->bar->width - x, seat->bar->textpadding))) {
+	} else if (px < (x += TEXT_WIDTH(font, bar->layout, bar->width - x, bar->textpadding))) {
 		/* Clicked on layout */
 		if (ipc) {
 			if (seat->pointer_button == BTN_LEFT)
-				zdwl_ipc_output_v2_set_layout(seat->bar->dwl_wm_output, seat->bar->last_layout_idx);
+				zdwl_ipc_output_v2_set_layout(bar->dwl_wm_output, bar->last_layout_idx);
 			else if (seat->pointer_button == BTN_RIGHT)
-				zdwl_ipc_output_v2_set_layout(seat->bar->dwl_wm_output, 2);
+				zdwl_ipc_output_v2_set_layout(bar->dwl_wm_output, 2);
 		}
 	} else {
-		uint32_t status_x = seat->bar->width / buffer_scale - TEXT_WIDTH(seat->bar->status.text, seat->bar->width - x, seat->bar->textpadding) / buffer_scale;
-		if (seat->pointer_x < status_x) {
+		CustomText *status = bar->status, *title = bar->title;
+		uint32_t status_x = bar->width;
+		if (status)
+			status_x -= TEXT_WIDTH(font, status->text, bar->width - x, bar->textpadding);
+		if (px < status_x) {
 			/* Clicked on title */
-			if (custom_title) {
+			if (custom_title && title) {
 				if (center_title) {
-					uint32_t title_width = TEXT_WIDTH(seat->bar->title.text, status_x - x, 0);
-					x = MAX(x, MIN((seat->bar->width - title_width) / 2, status_x - title_width));
+					uint32_t title_width = TEXT_WIDTH(font, title->text, status_x - x, 0);
+					x = MAX(x, MIN((bar->width - title_width) / 2, status_x - title_width));
 				} else {
-					x = MIN(x + seat->bar->textpadding, status_x);
-				}
-				for (i = 0; i < seat->bar->title.buttons_l; i++) {
-					if (seat->pointer_button == seat->bar->title.buttons[i].btn
-					    && seat->pointer_x >= x + seat->bar->title.buttons[i].x1
-					    && seat->pointer_x < x + seat->bar->title.buttons[i].x2) {
-						shell_command(seat->bar->title.buttons[i].command);
-						break;
-					}
+					x = MIN(x + bar->textpadding, status_x);
 				}
+				Button *button = button_at(font, title, seat->pointer_button, x, px);
+				if (button)
+					shell_command(button->command);
 			}
-		} else {
+		} else if (status) {
 			/* Clicked on status */
-			for (i = 0; i < seat->bar->status.buttons_l; i++) {
-			
-				if (seat->pointer_button == seat->bar->status.buttons[i].btn
-				    && seat->pointer_x >= status_x + seat->bar->textpadding + seat->bar->status.buttons[i].x1 / buffer_scale
-				    && seat->pointer_x < status_x + seat->bar->textpadding + seat->bar->status.buttons[i].x2 / buffer_scale) {
-					shell_command(seat->bar->status.buttons[i].command);
-					break;
-				}
-			}
+			Button *button = button_at(font, status, seat->pointer_button,
+						   status_x + bar->textpadding, px);
+			if (button)
+				status_button(bar, button);
 		}
 	}
 	
@@ -743,24 +1656,22 @@ static void
 pointer_axis_discrete(void *data, struct wl_pointer *pointer,
 		      uint32_t axis, int32_t discrete)
 {
-	uint32_t i;
 	uint32_t btn = discrete < 0 ? WheelUp : WheelDown;
 	Seat *seat = (Seat *)data;
 
-	if (!seat->bar)
+	if (!seat->bar || !seat->bar->status)
 		return;
 
-	uint32_t status_x = seat->bar->width / buffer_scale - TEXT_WIDTH(seat->bar->status.text, seat->bar->width, seat->bar->textpadding) / buffer_scale;
-	if (seat->pointer_x > status_x) {
+	Bar *bar = seat->bar;
+	CustomText *status = bar->status;
+	struct fcft_font *font = bar->scale->font;
+	const uint32_t px = seat->pointer_x * bar->scale->scale;
+	uint32_t status_x = bar->width - TEXT_WIDTH(font, status->text, bar->width, bar->textpadding);
+	if (px > status_x) {
 		/* Clicked on status */
-		for (i = 0; i < seat->bar->status.buttons_l; i++) {
-			if (btn == seat->bar->status.buttons[i].btn
-			    && seat->pointer_x >= status_x + seat->bar->textpadding + seat->bar->status.buttons[i].x1 / buffer_scale
-			    && seat->pointer_x < status_x + seat->bar->textpadding + seat->bar->status.buttons[i].x2 / buffer_scale) {
-				shell_command(seat->bar->status.buttons[i].command);
-				break;
-			}
-		}
+		Button *button = button_at(font, status, btn, status_x + bar->textpadding, px);
+		if (button)
+			status_button(bar, button);
 	}
 }
 
@@ -821,38 +1732,215 @@ static const struct wl_seat_listener seat_listener = {
 	.name = seat_name,
 };
 
+/* Queue data for a client, writing as much as possible right away. A
+ * subscriber that falls too far behind is disconnected rather than
+ * allowed to hold up the bar. */
 static void
-show_bar(Bar *bar)
+client_write(Client *client, const char *data, uint32_t len)
+{
+	if (client->dead)
+		return;
+
+	if (!client->out_l) {
+		ssize_t rv = send(client->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rv == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				client->dead = true;
+				return;
+			}
+			rv = 0;
+		}
+		data += rv;
+		len -= rv;
+	}
+	if (!len)
+		return;
+
+	if (client->out_l + len > SUBSCRIBER_BUF_MAX) {
+		client->dead = true;
+		return;
+	}
+	uint32_t off = client->out_l;
+	if (!off)
+		event_modify(client->fd, EPOLLIN | EPOLLOUT);
+	ARRAY_EXPAND(client->out, client->out_l, client->out_c, len);
+	memcpy(client->out + off, data, len);
+}
+
+static void
+flush_client(Client *client)
+{
+	ssize_t rv = send(client->fd, client->out, client->out_l, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rv == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			client->dead = true;
+		return;
+	}
+	client->out_l -= rv;
+	memmove(client->out, client->out + rv, client->out_l);
+	if (!client->out_l)
+		event_modify(client->fd, EPOLLIN);
+}
+
+static void
+append_event(char *buf, uint32_t *len, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+
+	/* Keep every event on one line, even a truncated one */
+	uint32_t end = MIN(*len + (uint32_t)MAX(n, 0), size - 2);
+	for (uint32_t i = *len; i < end; i++)
+		if (buf[i] == '\n')
+			buf[i] = ' ';
+	buf[end] = '\n';
+	*len = end + 1;
+}
+
+/* Up to 64 tags a set is printed as a decimal mask, as dwl does,
+ * beyond that in hexadecimal */
+static const char *
+format_tagset(char *buf, size_t size, const uint64_t *set, uint32_t words)
+{
+	if (words <= 1) {
+		snprintf(buf, size, "%" PRIu64, words ? set[0] : 0);
+		return buf;
+	}
+	int len = snprintf(buf, size, "0x%" PRIx64, set[words - 1]);
+	for (uint32_t w = words - 1; w-- > 0 && len > 0 && (size_t)len < size; )
+		len += snprintf(buf + len, size - len, "%016" PRIx64, set[w]);
+	return buf;
+}
+
+/* Send one line per selected piece of bar state to subscribers, or to
+ * the given client only */
+static void
+publish_to(Client *only, Bar *bar, uint32_t what)
 {
-	bar->wl_surface = wl_compositor_create_surface(compositor);
-	if (!bar->wl_surface)
-		DIE("Could not create wl_surface");
+	char buf[TEXT_MAX + 256];
+	uint32_t len = 0;
+	const char *name = bar->output_name;
 
-	bar->layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, bar->wl_surface, bar->wl_output,
-								   ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM, PROGRAM);
-	if (!bar->layer_surface)
-		DIE("Could not create layer_surface");
-	zwlr_layer_surface_v1_add_listener(bar->layer_surface, &layer_surface_listener, bar);
+	if (!name || (!only && !subscribers_l))
+		return;
+
+	if (what & EventTags) {
+		const uint64_t *bits = bar->tagbits.bits;
+		const uint32_t words = bar->tagbits.words;
+		char c[512], m[512], u[512];
+		append_event(buf, &len, sizeof buf, "%s tags %s %s %s", name,
+			     format_tagset(c, sizeof c, TAGSET(bits, words, TagOccupied), words),
+			     format_tagset(m, sizeof m, TAGSET(bits, words, TagActive), words),
+			     format_tagset(u, sizeof u, TAGSET(bits, words, TagUrgent), words));
+	}
+	if (what & EventLayout)
+		append_event(buf, &len, sizeof buf, "%s layout %s", name, bar->layout ? bar->layout : "");
+	if (what & EventTitle)
+		append_event(buf, &len, sizeof buf, "%s title %s", name, bar->window_title ? bar->window_title : "");
+	if (what & EventSelmon)
+		append_event(buf, &len, sizeof buf, "%s selmon %u", name, bar->sel);
+	if (what & EventVisible)
+		append_event(buf, &len, sizeof buf, "%s visible %u", name, !bar->hidden);
+	if (what & EventLocation)
+		append_event(buf, &len, sizeof buf, "%s location %s", name, bar->bottom ? "bottom" : "top");
+
+	if (only) {
+		client_write(only, buf, len);
+		return;
+	}
+
+	Client *client;
+	wl_list_for_each(client, &client_list, link)
+		if (client->subscribed)
+			client_write(client, buf, len);
+}
+
+#define publish(bar, what) publish_to(NULL, (bar), (what))
 
-	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->height / buffer_scale);
+/* Surfaces are created on the first show and live as long as the bar.
+ * Hiding unmaps them; a commit without a buffer maps them again and the
+ * configure that follows puts the last frame back. */
+static void
+show_bar(Bar *bar)
+{
+	if (!bar->layer_surface) {
+		bar->wl_surface = wl_compositor_create_surface(compositor);
+		if (!bar->wl_surface)
+			DIE("Could not create wl_surface");
+		wl_surface_set_user_data(bar->wl_surface, bar);
+
+		bar->layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, bar->wl_surface, bar->wl_output,
+									   ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM, PROGRAM);
+		if (!bar->layer_surface)
+			DIE("Could not create layer_surface");
+		zwlr_layer_surface_v1_add_listener(bar->layer_surface, &layer_surface_listener, bar);
+	}
+
+	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->scale->height);
 	zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
 					 (bar->bottom ? ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM : ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP)
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, bar->height / buffer_scale);
+	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface,
+						 bar->fullscreen && fullscreen_release_zone ? 0 : bar->scale->height);
 	wl_surface_commit(bar->wl_surface);
 
 	bar->hidden = false;
+	publish(bar, EventVisible);
 }
 
 static void
 hide_bar(Bar *bar)
 {
-	zwlr_layer_surface_v1_destroy(bar->layer_surface);
-	wl_surface_destroy(bar->wl_surface);
+	wl_surface_attach(bar->wl_surface, NULL, 0, 0);
+	wl_surface_commit(bar->wl_surface);
 
 	bar->configured = false;
 	bar->hidden = true;
+	publish(bar, EventVisible);
+}
+
+/* While fullscreen the bar keeps its state but neither renders nor commits;
+ * leaving fullscreen draws it once with whatever changed meanwhile */
+static void
+set_fullscreen(Bar *bar, bool fullscreen)
+{
+	if (bar->fullscreen == fullscreen)
+		return;
+	bar->fullscreen = fullscreen;
+	if (!fullscreen)
+		bar->dirty |= DirtyAll;
+	if (!bar->hidden && fullscreen_release_zone) {
+		zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface,
+							 fullscreen ? 0 : bar->scale->height);
+		wl_surface_commit(bar->wl_surface);
+	}
+}
+
+/* Grow or shrink each set to words, keeping the bits that still fit */
+static void
+tagbits_resize(TagBits *t, uint32_t words)
+{
+	if (t->words == words)
+		return;
+	uint64_t *bits = calloc(TagSets * words, sizeof(uint64_t));
+	if (words && !bits)
+		EDIE("calloc");
+	const uint32_t keep = MIN(words, t->words);
+	for (uint32_t set = 0; set < TagSets && keep; set++)
+		memcpy(TAGSET(bits, words, set), TAGSET(t->bits, t->words, set), keep * sizeof(uint64_t));
+	free(t->bits);
+	t->bits = bits;
+	t->words = words;
+}
+
+static void
+tag_set(uint64_t *set, uint32_t tag, bool on)
+{
+	const uint64_t bit = (uint64_t)1 << tag % 64;
+	set[tag / 64] = on ? set[tag / 64] | bit : set[tag / 64] & ~bit;
 }
 
 static void
@@ -866,6 +1954,12 @@ dwl_wm_tags(void *data, struct zdwl_ipc_manager_v2 *dwl_wm,
 	for (; i < amount; i++)
 		if (!(tags[i] = strdup(tags_names[MIN(i, LENGTH(tags_names)-1)])))
 			EDIE("strdup");
+
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		tagbits_resize(&bar->tagbits, TAGWORDS(tags_l));
+		tagbits_resize(&bar->pending_tagbits, TAGWORDS(tags_l));
+	}
 }
 
 static void
@@ -900,8 +1994,7 @@ dwl_wm_output_active(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 {
 	Bar *bar = (Bar *)data;
 
-	if (active != bar->sel)
-		bar->sel = active;
+	bar->pending_sel = active;
 }
 
 static void
@@ -909,19 +2002,14 @@ dwl_wm_output_tag(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	uint32_t tag, uint32_t state, uint32_t clients, uint32_t focused)
 {
 	Bar *bar = (Bar *)data;
+	uint64_t *bits = bar->pending_tagbits.bits;
+	const uint32_t words = bar->pending_tagbits.words;
 
-	if (state & ZDWL_IPC_OUTPUT_V2_TAG_STATE_ACTIVE)
-		bar->mtags |= 1 << tag;
-	else
-		bar->mtags &= ~(1 << tag);
-	if (clients > 0)
-		bar->ctags |= 1 << tag;
-	else
-		bar->ctags &= ~(1 << tag);
-	if (state & ZDWL_IPC_OUTPUT_V2_TAG_STATE_URGENT)
-		bar->urg |= 1 << tag;
-	else
-		bar->urg &= ~(1 << tag);
+	if (tag >= words * 64)
+		return;
+	tag_set(TAGSET(bits, words, TagActive), tag, state & ZDWL_IPC_OUTPUT_V2_TAG_STATE_ACTIVE);
+	tag_set(TAGSET(bits, words, TagOccupied), tag, clients > 0);
+	tag_set(TAGSET(bits, words, TagUrgent), tag, state & ZDWL_IPC_OUTPUT_V2_TAG_STATE_URGENT);
 }
 
 static void
@@ -930,8 +2018,7 @@ dwl_wm_output_layout(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 {
 	Bar *bar = (Bar *)data;
 
-	bar->last_layout_idx = bar->layout_idx;
-	bar->layout_idx = layout;
+	bar->pending_layout_idx = layout;
 }
 
 static void
@@ -943,9 +2030,9 @@ dwl_wm_output_title(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 
 	Bar *bar = (Bar *)data;
 
-	if (bar->window_title)
-		free(bar->window_title);
-	if (!(bar->window_title = strdup(title)))
+	if (bar->pending_title)
+		free(bar->pending_title);
+	if (!(bar->pending_title = strdup(title)))
 		EDIE("strdup");
 }
 
@@ -961,24 +2048,73 @@ dwl_wm_output_layout_symbol(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output
 {
 	Bar *bar = (Bar *)data;
 
-	if (layouts[bar->layout_idx])
-		free(layouts[bar->layout_idx]);
-	if (!(layouts[bar->layout_idx] = strdup(layout)))
+	if (bar->pending_layout)
+		free(bar->pending_layout);
+	if (!(bar->pending_layout = strdup(layout)))
 		EDIE("strdup");
-	bar->layout = layouts[bar->layout_idx];
 }
 
+/* Take a staged string if it differs from the current one */
+static bool
+apply_pending(char **cur, char **pending)
+{
+	if (!*pending)
+		return false;
+	if (*cur && !strcmp(*cur, *pending)) {
+		free(*pending);
+		*pending = NULL;
+		return false;
+	}
+	free(*cur);
+	*cur = *pending;
+	*pending = NULL;
+	return true;
+}
+
+/* dwl resends the state of every output whenever anything changes, so
+ * only what differs from the last frame is redrawn and published */
 static void
 dwl_wm_output_frame(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output)
 {
 	Bar *bar = (Bar *)data;
-	bar->redraw = true;
+	uint32_t changed = 0;
+
+	const size_t tagsize = TagSets * bar->tagbits.words * sizeof(uint64_t);
+	if (tagsize && memcmp(bar->tagbits.bits, bar->pending_tagbits.bits, tagsize)) {
+		memcpy(bar->tagbits.bits, bar->pending_tagbits.bits, tagsize);
+		changed |= EventTags;
+		bar->dirty |= DirtyTags;
+	}
+	if (bar->pending_layout_idx != bar->layout_idx) {
+		bar->last_layout_idx = bar->layout_idx;
+		bar->layout_idx = bar->pending_layout_idx;
+	}
+	if (apply_pending(&bar->layout, &bar->pending_layout)) {
+		changed |= EventLayout;
+		bar->dirty |= DirtyLayout;
+	}
+	if (apply_pending(&bar->window_title, &bar->pending_title)) {
+		changed |= EventTitle;
+		bar->dirty |= DirtyTitle;
+	}
+	if (bar->pending_sel != bar->sel) {
+		set_sel(bar, bar->pending_sel);
+		changed |= EventSelmon;
+		bar->dirty |= DirtyTags | DirtyTitle;
+	}
+	set_fullscreen(bar, bar->pending_fullscreen);
+
+	if (changed)
+		publish(bar, changed);
 }
 
 static void
 dwl_wm_output_fullscreen(void *data, struct zdwl_ipc_output_v2 *dwl_wm_output,
 	uint32_t is_fullscreen)
 {
+	Bar *bar = (Bar *)data;
+
+	bar->pending_fullscreen = is_fullscreen;
 }
 
 static void
@@ -1000,18 +2136,51 @@ static const struct zdwl_ipc_output_v2_listener dwl_wm_output_listener = {
 	.floating = dwl_wm_output_floating
 };
 
+/* Changes made while the output was off stay dirty and are drawn in
+ * one frame when it comes back on */
+static void
+output_power_mode(void *data, struct zwlr_output_power_v1 *output_power, uint32_t mode)
+{
+	Bar *bar = (Bar *)data;
+
+	bar->powered_off = mode == ZWLR_OUTPUT_POWER_V1_MODE_OFF;
+}
+
+static void
+output_power_failed(void *data, struct zwlr_output_power_v1 *output_power)
+{
+	Bar *bar = (Bar *)data;
+
+	zwlr_output_power_v1_destroy(bar->output_power);
+	bar->output_power = NULL;
+	bar->powered_off = false;
+}
+
+static const struct zwlr_output_power_v1_listener output_power_listener = {
+	.mode = output_power_mode,
+	.failed = output_power_failed
+};
+
+/* Only bars set up are in bar_list, the others are only indexed by
+ * registry name */
 static void
 setup_bar(Bar *bar)
 {
-	bar->height = height * buffer_scale;
-	bar->textpadding = textpadding;
+	wl_list_insert(&bar_list, &bar->link);
+	update_scale(bar);
 	bar->bottom = bottom;
 	bar->hidden = hidden;
-
-	bar->xdg_output = zxdg_output_manager_v1_get_xdg_output(output_manager, bar->wl_output);
-	if (!bar->xdg_output)
-		DIE("Could not create xdg_output");
-	zxdg_output_v1_add_listener(bar->xdg_output, &output_listener, bar);
+	if (module_status)
+		set_customtext(&bar->status, module_status);
+	tagbits_resize(&bar->tagbits, TAGWORDS(tags_l));
+	tagbits_resize(&bar->pending_tagbits, TAGWORDS(tags_l));
+
+	if (wl_output_get_version(bar->wl_output) < WL_OUTPUT_NAME_SINCE_VERSION && output_manager) {
+		bar->xdg_output = zxdg_output_manager_v1_get_xdg_output(output_manager, bar->wl_output);
+		if (!bar->xdg_output)
+			DIE("Could not create xdg_output");
+		zxdg_output_v1_add_listener(bar->xdg_output, &xdg_output_listener, bar);
+	}
 
 	if (ipc) {
 		bar->dwl_wm_output = zdwl_ipc_manager_v2_get_output(dwl_wm, bar->wl_output);
@@ -1019,11 +2188,74 @@ setup_bar(Bar *bar)
 			DIE("Could not create dwl_wm_output");
 		zdwl_ipc_output_v2_add_listener(bar->dwl_wm_output, &dwl_wm_output_listener, bar);
 	}
+
+	if (power_manager) {
+		bar->output_power = zwlr_output_power_manager_v1_get_output_power(power_manager, bar->wl_output);
+		if (!bar->output_power)
+			DIE("Could not create output_power");
+		zwlr_output_power_v1_add_listener(bar->output_power, &output_power_listener, bar);
+	}
 	
 	if (!bar->hidden)
 		show_bar(bar);
 }
 
+static void
+output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+		int32_t physical_width, int32_t physical_height, int32_t subpixel,
+		const char *make, const char *model, int32_t transform)
+{
+}
+
+static void
+output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+	    int32_t width, int32_t height, int32_t refresh)
+{
+}
+
+/* Bars are set up once their output has sent its first batch of
+ * properties, so they start out named and at the right scale */
+static void
+output_done(void *data, struct wl_output *wl_output)
+{
+	Bar *bar = (Bar *)data;
+
+	if (run_display && !bar->scale)
+		setup_bar(bar);
+}
+
+static void
+output_scale(void *data, struct wl_output *wl_output, int32_t factor)
+{
+	Bar *bar = (Bar *)data;
+
+	bar->output_scale = factor;
+	if (bar->scale)
+		update_scale(bar);
+}
+
+/* Sent by wl_output v4 right after binding, before any xdg_output
+ * could have been created */
+static void
+output_name(void *data, struct wl_output *wl_output, const char *name)
+{
+	set_output_name((Bar *)data, name);
+}
+
+static void
+output_description(void *data, struct wl_output *wl_output, const char *description)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_geometry,
+	.mode = output_mode,
+	.done = output_done,
+	.scale = output_scale,
+	.name = output_name,
+	.description = output_description
+};
+
 static void
 handle_global(void *data, struct wl_registry *registry,
 	      uint32_t name, const char *interface, uint32_t version)
@@ -1041,20 +2273,28 @@ handle_global(void *data, struct wl_registry *registry,
 			dwl_wm = wl_registry_bind(registry, name, &zdwl_ipc_manager_v2_interface, 2);
 			zdwl_ipc_manager_v2_add_listener(dwl_wm, &dwl_wm_listener, NULL);
 		}
+	} else if (follow_output_power && !strcmp(interface, zwlr_output_power_manager_v1_interface.name)) {
+		power_manager = wl_registry_bind(registry, name, &zwlr_output_power_manager_v1_interface, 1);
 	} else if (!strcmp(interface, wl_output_interface.name)) {
 		Bar *bar = calloc(1, sizeof(Bar));
 		if (!bar)
 			EDIE("calloc");
 		bar->registry_name = name;
-		bar->wl_output = wl_registry_bind(registry, name, &wl_output_interface, 1);
-		if (run_display)
+		bar->id_next = bars_by_id[name % INDEX_SIZE];
+		bars_by_id[name % INDEX_SIZE] = bar;
+		bar->wl_output = wl_registry_bind(registry, name, &wl_output_interface, MIN(version, 4));
+		wl_output_add_listener(bar->wl_output, &output_listener, bar);
+		/* Outputs without a done event are set up right away */
+		if (run_display && version < WL_OUTPUT_DONE_SINCE_VERSION)
 			setup_bar(bar);
-		wl_list_insert(&bar_list, &bar->link);
+		wl_list_init(&bar->link);
 	} else if (!strcmp(interface, wl_seat_interface.name)) {
 		Seat *seat = calloc(1, sizeof(Seat));
 		if (!seat)
 			EDIE("calloc");
 		seat->registry_name = name;
+		seat->id_next = seats_by_id[name % INDEX_SIZE];
+		seats_by_id[name % INDEX_SIZE] = seat;
 		seat->wl_seat = wl_registry_bind(registry, name, &wl_seat_interface, 7);
 		wl_seat_add_listener(seat->wl_seat, &seat_listener, seat);
 		wl_list_insert(&seat_list, &seat->link);
@@ -1064,28 +2304,48 @@ handle_global(void *data, struct wl_registry *registry,
 static void
 teardown_bar(Bar *bar)
 {
-	if (bar->status.colors)
-		free(bar->status.colors);
-	if (bar->status.buttons)
-		free(bar->status.buttons);
-	if (bar->title.colors)
-		free(bar->title.colors);
-	if (bar->title.buttons)
-		free(bar->title.buttons);
+	customtext_unref(bar->status);
+	customtext_unref(bar->title);
 	if (bar->window_title)
 		free(bar->window_title);
-	if (!ipc && bar->layout)
+	if (bar->layout)
 		free(bar->layout);
-	if (ipc)
+	free(bar->pending_layout);
+	free(bar->pending_title);
+	free(bar->tagbits.bits);
+	free(bar->pending_tagbits.bits);
+	if (bar->dwl_wm_output)
 		zdwl_ipc_output_v2_destroy(bar->dwl_wm_output);
-	if (bar->xdg_output_name)
-		free(bar->xdg_output_name);
-	if (!bar->hidden) {
+	if (bar->output_power)
+		zwlr_output_power_v1_destroy(bar->output_power);
+	unindex_bar_name(bar);
+	if (selbar == bar)
+		selbar = NULL;
+	if (bar->output_name)
+		free(bar->output_name);
+	/* Its cursor surface may go with its scale */
+	Seat *seat;
+	wl_list_for_each(seat, &seat_list, link) {
+		if (seat->bar == bar) {
+			wl_pointer_set_cursor(seat->wl_pointer, seat->enter_serial, NULL, 0, 0);
+			seat->bar = NULL;
+		}
+	}
+	if (bar->layer_surface) {
 		zwlr_layer_surface_v1_destroy(bar->layer_surface);
 		wl_surface_destroy(bar->wl_surface);
 	}
-	zxdg_output_v1_destroy(bar->xdg_output);
-	wl_output_destroy(bar->wl_output);
+	if (bar->buffer)
+		wl_buffer_destroy(bar->buffer);
+	if (bar->xdg_output)
+		zxdg_output_v1_destroy(bar->xdg_output);
+	if (wl_output_get_version(bar->wl_output) >= WL_OUTPUT_RELEASE_SINCE_VERSION)
+		wl_output_release(bar->wl_output);
+	else
+		wl_output_destroy(bar->wl_output);
+	/* Callers unlink the bar first */
+	if (bar->scale)
+		release_scale(bar->scale);
 	free(bar);
 }
 
@@ -1101,18 +2361,19 @@ teardown_seat(Seat *seat)
 static void
 handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
-	Bar *bar;
-	Seat *seat;
-	
-	wl_list_for_each(bar, &bar_list, link) {
-		if (bar->registry_name == name) {
+	for (Bar **p = &bars_by_id[name % INDEX_SIZE]; *p; p = &(*p)->id_next) {
+		if ((*p)->registry_name == name) {
+			Bar *bar = *p;
+			*p = bar->id_next;
 			wl_list_remove(&bar->link);
 			teardown_bar(bar);
 			return;
 		}
 	}
-	wl_list_for_each(seat, &seat_list, link) {
-		if (seat->registry_name == name) {
+	for (Seat **p = &seats_by_id[name % INDEX_SIZE]; *p; p = &(*p)->id_next) {
+		if ((*p)->registry_name == name) {
+			Seat *seat = *p;
+			*p = seat->id_next;
 			wl_list_remove(&seat->link);
 			teardown_seat(seat);
 			return;
@@ -1142,89 +2403,110 @@ advance_word(char **beg, char **end)
 #define ADVANCE_IF_LAST_CONT() if (ADVANCE() == -1) continue
 #define ADVANCE_IF_LAST_RET() if (ADVANCE() == -1) return
 
+/* dwl's -s output carries tags as decimal masks, which fill the first word */
+static bool
+set_tag_word(Bar *bar, uint32_t set, const char *str)
+{
+	if (!bar->tagbits.words)
+		return false;
+	uint64_t *word = TAGSET(bar->tagbits.bits, bar->tagbits.words, set);
+	const uint64_t val = strtoull(str, NULL, 10);
+	if (*word == val)
+		return false;
+	*word = val;
+	return true;
+}
+
+/* One line of dwl's -s output */
 static void
-read_stdin(void)
+run_stdin_line(char *line)
 {
-	size_t len = 0;
-	for (;;) {
-		ssize_t rv = read(STDIN_FILENO, stdinbuf + len, stdinbuf_cap - len);
+	char *wordbeg, *wordend = line;
+
+	ADVANCE_IF_LAST_RET();
+
+	Bar *bar = find_bar(wordbeg);
+	if (!bar)
+		return;
+	
+	ADVANCE_IF_LAST_RET();
+
+	uint32_t val;
+	if (!strcmp(wordbeg, "tags")) {
+		ADVANCE_IF_LAST_RET();
+		bool changed = set_tag_word(bar, TagOccupied, wordbeg);
+		ADVANCE_IF_LAST_RET();
+		changed |= set_tag_word(bar, TagActive, wordbeg);
+		ADVANCE_IF_LAST_RET();
+		/* skip sel */
+		ADVANCE();
+		changed |= set_tag_word(bar, TagUrgent, wordbeg);
+		if (changed)
+			bar->dirty |= DirtyTags;
+		publish(bar, EventTags);
+	} else if (!strcmp(wordbeg, "layout")) {
+		if (bar->layout)
+			free(bar->layout);
+		if (!(bar->layout = strdup(wordend)))
+			EDIE("strdup");
+		bar->dirty |= DirtyLayout;
+		publish(bar, EventLayout);
+	} else if (!strcmp(wordbeg, "title")) {
+		if (custom_title)
+			return;
+		if (bar->window_title)
+			free(bar->window_title);
+		if (!(bar->window_title = strdup(wordend)))
+			EDIE("strdup");
+		bar->dirty |= DirtyTitle;
+		publish(bar, EventTitle);
+	} else if (!strcmp(wordbeg, "fullscreen")) {
+		ADVANCE();
+		set_fullscreen(bar, atoi(wordbeg));
+	} else if (!strcmp(wordbeg, "selmon")) {
+		ADVANCE();
+		if ((val = atoi(wordbeg)) != bar->sel) {
+			set_sel(bar, val);
+			bar->dirty |= DirtyTags | DirtyTitle;
+			publish(bar, EventSelmon);
+		}
+	}
+}
+
+/* Complete lines are run as soon as they are read and a partial line is
+ * carried over to the next read. Lines that do not fit in stdinbuf are
+ * dropped. Everything read in one go is applied before the next redraw,
+ * so a burst from one dwl frame produces a single frame. */
+static void
+read_stdin(void *data, uint32_t events)
+{
+	/* Bounded like read_client so a flood cannot starve the rest */
+	for (int i = 0; i < 16; i++) {
+		ssize_t rv = read(STDIN_FILENO, stdinbuf + stdinbuf_l, sizeof stdinbuf - 1 - stdinbuf_l);
 		if (rv == -1) {
-			if (errno == EWOULDBLOCK)
-				break;
+			if (errno == EWOULDBLOCK || errno == EINTR)
+				return;
 			EDIE("read");
 		}
 		if (rv == 0) {
 			run_display = false;
 			return;
 		}
-
-		if ((len += rv) > stdinbuf_cap / 2)
-			if (!(stdinbuf = realloc(stdinbuf, (stdinbuf_cap *= 2))))
-				EDIE("realloc");
-	}
-
-	char *linebeg, *lineend;
-	char *wordbeg, *wordend;
-	
-	for (linebeg = stdinbuf;
-	     (lineend = memchr(linebeg, '\n', stdinbuf + len - linebeg));
-	     linebeg = lineend) {
-		*lineend++ = '\0';
-		wordend = linebeg;
-
-		ADVANCE_IF_LAST_CONT();
-
-		Bar *it, *bar = NULL;
-		wl_list_for_each(it, &bar_list, link) {
-			if (it->xdg_output_name && !strcmp(wordbeg, it->xdg_output_name)) {
-				bar = it;
-				break;
-			}
+		stdinbuf_l += rv;
+
+		char *linebeg = stdinbuf, *lineend;
+		while ((lineend = memchr(linebeg, '\n', stdinbuf + stdinbuf_l - linebeg))) {
+			*lineend++ = '\0';
+			if (!stdin_overflow)
+				run_stdin_line(linebeg);
+			stdin_overflow = false;
+			linebeg = lineend;
 		}
-		if (!bar)
-			continue;
-		
-		ADVANCE_IF_LAST_CONT();
-
-		uint32_t val;
-		if (!strcmp(wordbeg, "tags")) {
-			ADVANCE_IF_LAST_CONT();
-			if ((val = atoi(wordbeg)) != bar->ctags) {
-				bar->ctags = val;
-				bar->redraw = true;
-			}
-			ADVANCE_IF_LAST_CONT();
-			if ((val = atoi(wordbeg)) != bar->mtags) {
-				bar->mtags = val;
-				bar->redraw = true;
-			}
-			ADVANCE_IF_LAST_CONT();
-			/* skip sel */
-			ADVANCE();
-			if ((val = atoi(wordbeg)) != bar->urg) {
-				bar->urg = val;
-				bar->redraw = true;
-			}
-		} else if (!strcmp(wordbeg, "layout")) {
-			if (bar->layout)
-				free(bar->layout);
-			if (!(bar->layout = strdup(wordend)))
-				EDIE("strdup");
-			bar->redraw = true;
-		} else if (!strcmp(wordbeg, "title")) {
-			if (custom_title)
-				continue;
-			if (bar->window_title)
-				free(bar->window_title);
-			if (!(bar->window_title = strdup(wordend)))
-				EDIE("strdup");
-			bar->redraw = true;
-		} else if (!strcmp(wordbeg, "selmon")) {
-			ADVANCE();
-			if ((val = atoi(wordbeg)) != bar->sel) {
-				bar->sel = val;
-				bar->redraw = true;
-			}
+		stdinbuf_l -= linebeg - stdinbuf;
+		memmove(stdinbuf, linebeg, stdinbuf_l);
+		if (stdinbuf_l == sizeof stdinbuf - 1) {
+			stdin_overflow = true;
+			stdinbuf_l = 0;
 		}
 	}
 }
@@ -1237,9 +2519,11 @@ set_top(Bar *bar)
 						 ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
 						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
 						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-		bar->redraw = true;
+		/* The same pixels, only somewhere else */
+		wl_surface_commit(bar->wl_surface);
 	}
 	bar->bottom = false;
+	publish(bar, EventLocation);
 }
 
 static void
@@ -1250,9 +2534,10 @@ set_bottom(Bar *bar)
 						 ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM
 						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
 						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-		bar->redraw = true;
+		wl_surface_commit(bar->wl_surface);
 	}
 	bar->bottom = true;
+	publish(bar, EventLocation);
 }
 
 /* Color parsing logic adapted from [sway] */
@@ -1284,16 +2569,17 @@ parse_color(const char *str, pixman_color_t *clr)
 	return 0;
 }
 
-static void
-parse_into_customtext(CustomText *ct, char *text)
+static CustomText *
+parse_into_customtext(char *text)
 {
-	ct->colors_l = ct->buttons_l = 0;
+	CustomText *ct = calloc(1, sizeof(CustomText));
+	if (!ct)
+		EDIE("calloc");
+	ct->refs = 1;
 
 	if (status_commands) {
 		uint32_t codepoint;
 		uint32_t state = UTF8_ACCEPT;
-		uint32_t last_cp = 0;
-		uint32_t x = 0;
 		size_t str_pos = 0;
 
 		Button *left_button = NULL;
@@ -1332,53 +2618,58 @@ parse_into_customtext(CustomText *ct, char *text)
 						color->start = ct->text + str_pos;
 					} else if (!strcmp(p, "lm")) {
 						if (left_button) {
-							left_button->x2 = x;
+							left_button->end = str_pos;
 							left_button = NULL;
 						} else if (*arg) {
 							ARRAY_APPEND(ct->buttons, ct->buttons_l, ct->buttons_c, left_button);
 							left_button->btn = BTN_LEFT;
 							snprintf(left_button->command, sizeof left_button->command, "%s", arg);
-							left_button->x1 = x;
+							left_button->start = str_pos;
+							left_button->src = p - 1 - text;
 						}
 					} else if (!strcmp(p, "mm")) {
 						if (middle_button) {
-							middle_button->x2 = x;
+							middle_button->end = str_pos;
 							middle_button = NULL;
 						} else if (*arg) {
 							ARRAY_APPEND(ct->buttons, ct->buttons_l, ct->buttons_c, middle_button);
 							middle_button->btn = BTN_MIDDLE;
 							snprintf(middle_button->command, sizeof middle_button->command, "%s", arg);
-							middle_button->x1 = x;
+							middle_button->start = str_pos;
+							middle_button->src = p - 1 - text;
 						}
 					} else if (!strcmp(p, "rm")) {
 						if (right_button) {
-							right_button->x2 = x;
+							right_button->end = str_pos;
 							right_button = NULL;
 						} else if (*arg) {
 							ARRAY_APPEND(ct->buttons, ct->buttons_l, ct->buttons_c, right_button);
 							right_button->btn = BTN_RIGHT;
 							snprintf(right_button->command, sizeof right_button->command, "%s", arg);
-							right_button->x1 = x;
+							right_button->start = str_pos;
+							right_button->src = p - 1 - text;
 						}
 					} else if (!strcmp(p, "us")) {
 						if (scrollup_button) {
-							scrollup_button->x2 = x;
+							scrollup_button->end = str_pos;
 							scrollup_button = NULL;
 						} else if (*arg) {
 							ARRAY_APPEND(ct->buttons, ct->buttons_l, ct->buttons_c, scrollup_button);
 							scrollup_button->btn = WheelUp;
 							snprintf(scrollup_button->command, sizeof scrollup_button->command, "%s", arg);
-							scrollup_button->x1 = x;
+							scrollup_button->start = str_pos;
+							scrollup_button->src = p - 1 - text;
 						}
 					} else if (!strcmp(p, "ds")) {
 						if (scrolldown_button) {
-							scrolldown_button->x2 = x;
+							scrolldown_button->end = str_pos;
 							scrolldown_button = NULL;
 						} else if (*arg) {
 							ARRAY_APPEND(ct->buttons, ct->buttons_l, ct->buttons_c, scrolldown_button);
 							scrolldown_button->btn = WheelDown;
 							snprintf(scrolldown_button->command, sizeof scrolldown_button->command, "%s", arg);
-							scrolldown_button->x1 = x;
+							scrolldown_button->start = str_pos;
+							scrolldown_button->src = p - 1 - text;
 						}
 					} 
 
@@ -1391,98 +2682,97 @@ parse_into_customtext(CustomText *ct, char *text)
 			}
 
 			ct->text[str_pos++] = *p;
-			
-			if (utf8decode(&state, &codepoint, *p))
-				continue;
-			
-			const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
-			if (!glyph)
-				continue;
-				
-			long kern = 0;
-			if (last_cp)
-				fcft_kerning(font, last_cp, codepoint, &kern, NULL);
-			last_cp = codepoint;
-			
-			x += kern + glyph->advance.x;
+			utf8decode(&state, &codepoint, *p);
 		}
 
 		if (left_button)
-			left_button->x2 = x;
+			left_button->end = str_pos;
 		if (middle_button)
-			middle_button->x2 = x;
+			middle_button->end = str_pos;
 		if (right_button)
-			right_button->x2 = x;
+			right_button->end = str_pos;
 		if (scrollup_button)
-			scrollup_button->x2 = x;
+			scrollup_button->end = str_pos;
 		if (scrolldown_button)
-			scrolldown_button->x2 = x;
+			scrolldown_button->end = str_pos;
 	
 		
 		ct->text[str_pos] = '\0';
 	} else {
 		snprintf(ct->text, sizeof ct->text, "%s", text);
 	}
+
+	return ct;
 }
 
+/* Set up the status cache, in the state file if enabled, and give its
+ * entries to the bars already named. Each instance name has its own file,
+ * which is only ever mapped by the instance holding that name. */
 static void
-copy_customtext(CustomText *from, CustomText *to)
+setup_cache(void)
 {
-	snprintf(to->text, sizeof to->text, "%s", from->text);
-	to->colors_l = to->buttons_l = 0;
-	for (uint32_t i = 0; i < from->colors_l; i++) {
-		Color *color;
-		ARRAY_APPEND(to->colors, to->colors_l, to->colors_c, color);
-		color->color = from->colors[i].color;
-		color->bg = from->colors[i].bg;
-		color->start = from->colors[i].start - (char *)&from->text + (char *)&to->text;
+	if (state_file) {
+		char path[sizeof socketdir + sizeof instance_name + 8];
+		snprintf(path, sizeof path, "%s/state-%s", socketdir, instance_name);
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd != -1 && ftruncate(fd, sizeof(Cache)) == 0
+		    && (cache = mmap(NULL, sizeof(Cache), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED)
+			cache_mapped = true;
+		else
+			fprintf(stderr, "Could not map '%s': %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+	}
+	if (!cache_mapped && !(cache = calloc(1, sizeof(Cache))))
+		EDIE("calloc");
+
+	if (cache->magic != CACHE_MAGIC || cache->size != sizeof(Cache)) {
+		memset(cache, 0, sizeof(Cache));
+		cache->magic = CACHE_MAGIC;
+		cache->size = sizeof(Cache);
 	}
-	for (uint32_t i = 0; i < from->buttons_l; i++) {
-		Button *button;
-		ARRAY_APPEND(to->buttons, to->buttons_l, to->buttons_c, button);
-		*button = from->buttons[i];
+	/* Parsing modifies the text, so work on a copy of each entry */
+	char *text = malloc(TEXT_MAX);
+	if (!text)
+		EDIE("malloc");
+	for (uint32_t i = 0; i < CACHE_ENTRIES; i++) {
+		CacheEntry *entry = &cache->entries[i];
+		if (!entry->stamp)
+			continue;
+		entry->name[sizeof entry->name - 1] = '\0';
+		for (uint32_t title = 0; title < 2; title++) {
+			memcpy(text, title ? entry->title : entry->status, TEXT_MAX);
+			text[TEXT_MAX - 1] = '\0';
+			if (*text)
+				cached[i][title] = parse_into_customtext(text);
+		}
+		cache_stamp = MAX(cache_stamp, entry->stamp);
 	}
+	free(text);
+
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link)
+		if (bar->output_name)
+			cache_restore(bar);
 }
 
 static void
-read_socket(void)
+run_command(char *cmd)
 {
-	int cli_fd;
-	if ((cli_fd = accept(sock_fd, NULL, 0)) == -1)
-		EDIE("accept");
-	ssize_t len = recv(cli_fd, sockbuf, sizeof sockbuf - 1, 0);
-	if (len == -1)
-		EDIE("recv");
-	close(cli_fd);
-	if (len == 0)
-		return;
-	sockbuf[len] = '\0';
-
 	char *wordbeg, *wordend;
-	wordend = (char *)&sockbuf;
+	wordend = cmd;
 
 	ADVANCE_IF_LAST_RET();
 		
-	Bar *bar = NULL, *it;
+	Bar *bar = NULL;
 	bool all = false;
 		
-	if (!strcmp(wordbeg, "all")) {
+	if (!strcmp(wordbeg, "all"))
 		all = true;
-	} else if (!strcmp(wordbeg, "selected")) {
-		wl_list_for_each(it, &bar_list, link) {
-			if (it->sel) {
-				bar = it;
-				break;
-			}
-		}
-	} else {
-		wl_list_for_each(it, &bar_list, link) {
-			if (it->xdg_output_name && !strcmp(wordbeg, it->xdg_output_name)) {
-				bar = it;
-				break;
-			}
-		}
-	}
+	else if (!strcmp(wordbeg, "selected"))
+		bar = selbar;
+	else
+		bar = find_bar(wordbeg);
 		
 	if (!all && !bar)
 		return;
@@ -1492,39 +2782,35 @@ read_socket(void)
 	if (!strcmp(wordbeg, "status")) {
 		if (!*wordend)
 			return;
+		CustomText *ct = parse_into_customtext(wordend);
 		if (all) {
-			Bar *first = NULL;
 			wl_list_for_each(bar, &bar_list, link) {
-				if (first) {
-					copy_customtext(&first->status, &bar->status);
-				} else {
-					parse_into_customtext(&bar->status, wordend);
-					first = bar;
-				}
-				bar->redraw = true;
+				set_customtext(&bar->status, ct);
+				cache_store(bar, false, ct, wordend);
+				bar->dirty |= DirtyStatus;
 			}
 		} else {
-			parse_into_customtext(&bar->status, wordend);
-			bar->redraw = true;
+			set_customtext(&bar->status, ct);
+			cache_store(bar, false, ct, wordend);
+			bar->dirty |= DirtyStatus;
 		}
+		customtext_unref(ct);
 	} else if (!strcmp(wordbeg, "title")) {
 		if (!custom_title || !*wordend)
 			return;
+		CustomText *ct = parse_into_customtext(wordend);
 		if (all) {
-			Bar *first = NULL;
 			wl_list_for_each(bar, &bar_list, link) {
-				if (first) {
-					copy_customtext(&first->title, &bar->title);
-				} else {
-					parse_into_customtext(&bar->title, wordend);
-					first = bar;
-				}
-				bar->redraw = true;
+				set_customtext(&bar->title, ct);
+				cache_store(bar, true, ct, wordend);
+				bar->dirty |= DirtyTitle;
 			}
 		} else {
-			parse_into_customtext(&bar->title, wordend);
-			bar->redraw = true;
+			set_customtext(&bar->title, ct);
+			cache_store(bar, true, ct, wordend);
+			bar->dirty |= DirtyTitle;
 		}
+		customtext_unref(ct);
 	} else if (!strcmp(wordbeg, "show")) {
 		if (all) {
 			wl_list_for_each(bar, &bar_list, link)
@@ -1592,92 +2878,1432 @@ read_socket(void)
 	}
 }
 
+static void
+close_client(Client *client)
+{
+	if (client->subscribed)
+		subscribers_l--;
+	event_remove(client->fd);
+	close(client->fd);
+	wl_list_remove(&client->link);
+	if (client->ring) {
+		munmap(client->ring, sizeof(Ring) + RING_SIZE);
+		event_remove(client->ring_efd);
+		close(client->ring_efd);
+	}
+	free(client->batch);
+	free(client->out);
+	free(client);
+	clients_l--;
+}
+
+/* Run every line of a self-contained message */
+static void
+run_commands(char *buf)
+{
+	char *linebeg, *lineend;
+	for (linebeg = buf; linebeg; linebeg = lineend) {
+		if ((lineend = strchr(linebeg, '\n')))
+			*lineend++ = '\0';
+		if (*linebeg && strcmp(linebeg, "begin") && strcmp(linebeg, "commit"))
+			run_command(linebeg);
+	}
+}
+
+static void
+ring_copy(Ring *ring, uint32_t pos, void *dst, uint32_t len)
+{
+	uint32_t off = pos % RING_SIZE, first = MIN(len, RING_SIZE - off);
+	memcpy(dst, ring->data + off, first);
+	memcpy((char *)dst + first, ring->data, len - first);
+}
+
+/* Consume every record the producer has published. The shared head is
+ * validated since the producer may be buggy; our own tail is kept
+ * privately and only mirrored into the ring. */
+static void
+read_ring(void *data, uint32_t events)
+{
+	Client *client = (Client *)data;
+	Ring *ring = client->ring;
+	uint64_t count;
+
+	if (read(client->ring_efd, &count, sizeof count) == -1
+	    && errno != EAGAIN && errno != EWOULDBLOCK)
+		return;
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t tail = client->ring_tail;
+	while (tail != head) {
+		uint32_t avail = head - tail, len;
+		if (avail < sizeof len || avail > RING_SIZE)
+			goto corrupt;
+		ring_copy(ring, tail, &len, sizeof len);
+		if (len > avail - sizeof len)
+			goto corrupt;
+		tail += sizeof len;
+		if (len < sizeof sockbuf) {
+			ring_copy(ring, tail, sockbuf, len);
+			sockbuf[len] = '\0';
+			run_commands(sockbuf);
+		}
+		tail += len;
+	}
+
+	client->ring_tail = tail;
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	client->last_active = now_ms();
+	return;
+
+corrupt:
+	fprintf(stderr, "Dropping client with corrupt ring\n");
+	client->dead = true;
+}
+
+/* Hand the client a ring and an eventfd over SCM_RIGHTS. The memfd is
+ * sealed so the producer cannot shrink it under us. */
+static void
+setup_ring(Client *client)
+{
+	size_t size = sizeof(Ring) + RING_SIZE;
+	Ring *ring = MAP_FAILED;
+	int efd = -1;
+
+	if (client->ring)
+		return;
+
+	int memfd = memfd_create("dwlb-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1)
+		goto fail;
+	if (ftruncate(memfd, size) == -1
+	    || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+		goto fail;
+	if ((ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED)
+		goto fail;
+	ring->size = RING_SIZE;
+	if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		goto fail;
+
+	char reply[] = "ring\n";
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+	struct iovec iov = { .iov_base = reply, .iov_len = sizeof reply - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof control.buf
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), (int[]){ memfd, efd }, 2 * sizeof(int));
+	if (event_add(efd, EPOLLIN, read_ring, client) == -1)
+		goto fail;
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) == -1) {
+		event_remove(efd);
+		goto fail;
+	}
+
+	close(memfd);
+	client->ring = ring;
+	client->ring_efd = efd;
+	client->ring_tail = 0;
+	return;
+
+fail:
+	fprintf(stderr, "Could not set up ring: %s\n", strerror(errno));
+	if (efd != -1)
+		close(efd);
+	if (ring != MAP_FAILED)
+		munmap(ring, size);
+	if (memfd != -1)
+		close(memfd);
+}
+
+/* Lines between 'begin' and 'commit' are queued and only run once the
+ * batch is complete, so no frame shows a partially applied batch */
+static void
+client_handle_line(Client *client, char *line)
+{
+	if (!strcmp(line, "ring")) {
+		setup_ring(client);
+	} else if (!strcmp(line, "subscribe")) {
+		/* Start with a snapshot of every bar, then stream changes */
+		if (!client->subscribed) {
+			client->subscribed = true;
+			subscribers_l++;
+		}
+		Bar *bar;
+		wl_list_for_each(bar, &bar_list, link)
+			publish_to(client, bar, EventAll);
+	} else if (!strcmp(line, "begin")) {
+		client->batching = true;
+		client->batch_dropped = false;
+		client->batch_l = 0;
+	} else if (!strcmp(line, "commit")) {
+		if (client->batching && !client->batch_dropped)
+			for (char *cmd = client->batch; cmd < client->batch + client->batch_l; cmd += strlen(cmd) + 1)
+				run_command(cmd);
+		client->batching = false;
+		client->batch_l = 0;
+	} else if (client->batching) {
+		uint32_t len = strlen(line) + 1, off = client->batch_l;
+		if (client->batch_dropped || off + len > BATCH_MAX) {
+			client->batch_dropped = true;
+			return;
+		}
+		ARRAY_EXPAND(client->batch, client->batch_l, client->batch_c, len);
+		memcpy(client->batch + off, line, len);
+	} else {
+		run_command(line);
+	}
+}
+
+/* Commands are newline-terminated and a connection may carry any number
+ * of them. Whatever is left unterminated when the peer closes is run as
+ * a final command, so one-shot senders need not append a newline. */
+static void
+read_client(Client *client)
+{
+	/* A producer that gave up on its ring continues on the stream, so
+	 * whatever it published there comes first */
+	if (client->ring) {
+		read_ring(client, 0);
+		if (client->dead)
+			return;
+	}
+
+	/* Bounded so a flooding client cannot starve rendering and dispatch;
+	 * anything left over is picked up on the next iteration */
+	for (int i = 0; i < 4; i++) {
+		ssize_t len = recv(client->fd, client->buf + client->len,
+				   sizeof client->buf - client->len - 1, 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				close_client(client);
+			return;
+		}
+		if (len == 0) {
+			if (client->len && !client->overflow) {
+				client->buf[client->len] = '\0';
+				client_handle_line(client, client->buf);
+			}
+			close_client(client);
+			return;
+		}
+		client->len += len;
+		client->last_active = now_ms();
+
+		char *linebeg, *lineend;
+		for (linebeg = client->buf;
+		     (lineend = memchr(linebeg, '\n', client->buf + client->len - linebeg));
+		     linebeg = lineend) {
+			*lineend++ = '\0';
+			if (client->overflow)
+				client->overflow = false;
+			else
+				client_handle_line(client, linebeg);
+		}
+
+		client->len -= linebeg - client->buf;
+		memmove(client->buf, linebeg, client->len);
+		if (client->len == sizeof client->buf - 1) {
+			/* Line too long, drop it up to the next newline */
+			client->len = 0;
+			client->overflow = true;
+		}
+	}
+}
+
+/* Every datagram holds complete commands, so there is nothing to accept
+ * or reassemble, and all of its commands are applied before the next
+ * redraw without needing 'begin'/'commit' */
+static void
+read_dgram(void *data, uint32_t events)
+{
+	for (int i = 0; i < 16; i++) {
+		union {
+			char buf[CMSG_SPACE(sizeof(struct ucred))];
+			struct cmsghdr align;
+		} control;
+		struct iovec iov = { .iov_base = sockbuf, .iov_len = sizeof sockbuf - 1 };
+		struct msghdr msg = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = control.buf, .msg_controllen = sizeof control.buf
+		};
+		ssize_t len = recvmsg(dgram_fd, &msg, MSG_TRUNC);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "recv: %s\n", strerror(errno));
+			return;
+		}
+		if (len >= (ssize_t)sizeof sockbuf)
+			/* Truncated, drop it */
+			continue;
+
+		/* Only accept datagrams from our own user */
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		struct ucred cred;
+		if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+			continue;
+		memcpy(&cred, CMSG_DATA(cmsg), sizeof cred);
+		if (cred.uid != getuid())
+			continue;
+		sockbuf[len] = '\0';
+		run_commands(sockbuf);
+	}
+}
+
+static void
+client_event(void *data, uint32_t events)
+{
+	Client *client = (Client *)data;
+
+	if (!client->dead && (events & EPOLLOUT))
+		flush_client(client);
+	if (!client->dead && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		read_client(client);
+}
+
+static void
+accept_clients(void *data, uint32_t events)
+{
+	int cli_fd;
+	while ((cli_fd = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		/* Abstract sockets have no permissions, check the peer instead */
+		struct ucred cred;
+		socklen_t cred_len = sizeof cred;
+		if (clients_l >= CLIENTS_MAX
+		    || getsockopt(cli_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1
+		    || cred.uid != getuid()) {
+			close(cli_fd);
+			continue;
+		}
+
+		Client *client = calloc(1, sizeof(Client));
+		if (!client)
+			EDIE("calloc");
+		client->fd = cli_fd;
+		client->last_active = now_ms();
+		if (event_add(cli_fd, EPOLLIN, client_event, client) == -1) {
+			close(cli_fd);
+			free(client);
+			continue;
+		}
+		wl_list_insert(&client_list, &client->link);
+		clients_l++;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+}
+
+/* Clients holding a partial command are dropped after client_partial_timeout,
+ * silent ones after client_idle_timeout. Returns milliseconds until the next
+ * client deadline, or -1 if there is none. */
+static int64_t
+expire_clients(void)
+{
+	Client *client, *client2;
+	uint64_t now = now_ms();
+	int64_t next = -1;
+
+	wl_list_for_each_safe(client, client2, &client_list, link) {
+		uint32_t timeout = (client->len || client->overflow) ? client_partial_timeout
+			: (client->subscribed || client->ring) ? 0 : client_idle_timeout;
+		if (!timeout)
+			continue;
+		uint64_t deadline = client->last_active + (uint64_t)timeout * 1000;
+		if (deadline <= now) {
+			close_client(client);
+			continue;
+		}
+		if (next == -1 || (int64_t)(deadline - now) < next)
+			next = deadline - now;
+	}
+
+	return next;
+}
+
+/* Split status_format into literal text and modules. Unknown in-line
+ * commands such as ^fg() are kept as text for parse_into_customtext. */
+static void
+parse_status_format(const char *fmt)
+{
+	static const char *names[] = {
+		[ModClock] = "clock", [ModCpu] = "cpu", [ModMem] = "mem",
+		[ModLoad] = "load", [ModBat] = "bat", [ModFile] = "file",
+		[ModNet] = "net", [ModBacklight] = "backlight", [ModExec] = "exec"
+	};
+	const char *text = fmt, *p = fmt;
+	Module *module;
+
+	while (*p) {
+		if (*p != '^') {
+			p++;
+			continue;
+		}
+		if (p[1] == '^') {
+			p += 2;
+			continue;
+		}
+
+		uint32_t type = 0;
+		const char *arg = strchr(p, '('), *end = arg ? strchr(arg, ')') : NULL;
+		if (end)
+			for (uint32_t i = ModClock; i < LENGTH(names); i++)
+				if ((size_t)(arg - p - 1) == strlen(names[i]) && !strncmp(p + 1, names[i], arg - p - 1))
+					type = i;
+		if (!type) {
+			p++;
+			continue;
+		}
+
+		if (p > text) {
+			ARRAY_APPEND(modules, modules_l, modules_c, module);
+			memset(module, 0, sizeof(*module));
+			module->type = ModText;
+			if (!(module->arg = strndup(text, p - text)))
+				EDIE("strndup");
+		}
+		ARRAY_APPEND(modules, modules_l, modules_c, module);
+		memset(module, 0, sizeof(*module));
+		module->type = type;
+		if (!(module->arg = strndup(arg + 1, end - arg - 1)))
+			EDIE("strndup");
+		text = p = end + 1;
+	}
+	if (*text) {
+		ARRAY_APPEND(modules, modules_l, modules_c, module);
+		memset(module, 0, sizeof(*module));
+		module->type = ModText;
+		if (!(module->arg = strdup(text)))
+			EDIE("strdup");
+	}
+}
+
+/* Files are kept open and reread from the start on every update */
+static ssize_t
+read_module_file(int fd, char *buf, size_t size)
+{
+	if (fd == -1)
+		return -1;
+	ssize_t len = pread(fd, buf, size - 1, 0);
+	if (len >= 0)
+		buf[len] = '\0';
+	return len;
+}
+
+static void
+update_module(Module *module, time_t now)
+{
+	char buf[4096];
+
+	switch (module->type) {
+	case ModClock: {
+		struct tm tm;
+		localtime_r(&now, &tm);
+		if (!strftime(module->text, sizeof module->text, *module->arg ? module->arg : "%H:%M", &tm))
+			*module->text = '\0';
+		break;
+	}
+	case ModCpu: {
+		unsigned long long v[8] = { 0 }, total = 0;
+		if (read_module_file(module->fd, buf, sizeof buf) == -1
+		    || sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			      &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) {
+			snprintf(module->text, sizeof module->text, "?");
+			break;
+		}
+		for (uint32_t i = 0; i < LENGTH(v); i++)
+			total += v[i];
+		/* idle and iowait */
+		unsigned long long idle = v[3] + v[4];
+		unsigned long long dtotal = total - module->cpu_total, didle = idle - module->cpu_idle;
+		snprintf(module->text, sizeof module->text, "%u%%",
+			 dtotal ? (uint32_t)((dtotal - didle) * 100 / dtotal) : 0);
+		module->cpu_total = total;
+		module->cpu_idle = idle;
+		break;
+	}
+	case ModMem: {
+		unsigned long long total = 0, avail = 0;
+		char *p;
+		if (read_module_file(module->fd, buf, sizeof buf) == -1
+		    || !(p = strstr(buf, "MemTotal:")) || sscanf(p, "MemTotal: %llu", &total) != 1
+		    || !(p = strstr(buf, "MemAvailable:")) || sscanf(p, "MemAvailable: %llu", &avail) != 1
+		    || !total) {
+			snprintf(module->text, sizeof module->text, "?");
+			break;
+		}
+		snprintf(module->text, sizeof module->text, "%u%%", (uint32_t)((total - avail) * 100 / total));
+		break;
+	}
+	case ModLoad: {
+		float load;
+		if (read_module_file(module->fd, buf, sizeof buf) == -1 || sscanf(buf, "%f", &load) != 1)
+			snprintf(module->text, sizeof module->text, "?");
+		else
+			snprintf(module->text, sizeof module->text, "%.2f", load);
+		break;
+	}
+	case ModFile: {
+		/* The file may have been replaced, so it is reopened every time */
+		int fd = open(module->arg, O_RDONLY | O_CLOEXEC);
+		ssize_t len = read_module_file(fd, buf, sizeof module->text);
+		if (fd != -1)
+			close(fd);
+		if (len == -1)
+			*buf = '\0';
+		buf[strcspn(buf, "\n")] = '\0';
+		snprintf(module->text, sizeof module->text, "%s", buf);
+		break;
+	}
+	case ModNet: {
+		char path[128], state[32] = "";
+		snprintf(path, sizeof path, "/sys/class/net/%s/operstate", module->arg);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (read_module_file(fd, buf, sizeof buf) != -1)
+			sscanf(buf, "%31s", state);
+		if (fd != -1)
+			close(fd);
+		if (!*state) {
+			snprintf(module->text, sizeof module->text, "?");
+			break;
+		}
+
+		/* Show the first IPv4 address while the link is up */
+		struct ifaddrs *ifaddrs, *ifa;
+		char addr[INET_ADDRSTRLEN] = "";
+		if (!strcmp(state, "up") && getifaddrs(&ifaddrs) == 0) {
+			for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+				if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET
+				    && !strcmp(ifa->ifa_name, module->arg)) {
+					inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
+						  addr, sizeof addr);
+					break;
+				}
+			}
+			freeifaddrs(ifaddrs);
+		}
+		snprintf(module->text, sizeof module->text, "%s", *addr ? addr : state);
+		break;
+	}
+	case ModBacklight: {
+		/* Reading from the start also rearms the sysfs notification */
+		unsigned long long brightness;
+		if (read_module_file(module->fd, buf, sizeof buf) == -1
+		    || sscanf(buf, "%llu", &brightness) != 1 || !module->max_brightness) {
+			snprintf(module->text, sizeof module->text, "?");
+			break;
+		}
+		snprintf(module->text, sizeof module->text, "%u%%",
+			 (uint32_t)(brightness * 100 / module->max_brightness));
+		break;
+	}
+	case ModExec:
+		/* A periodic block still running from the last tick is left alone */
+		if (module->fd == -1)
+			module->refresh = true;
+		break;
+	case ModBat: {
+		uint32_t capacity;
+		char status[32] = "";
+		if (read_module_file(module->fd, buf, sizeof buf) == -1 || sscanf(buf, "%u", &capacity) != 1) {
+			snprintf(module->text, sizeof module->text, "?");
+			break;
+		}
+		if (read_module_file(module->fd2, buf, sizeof buf) != -1)
+			sscanf(buf, "%31s", status);
+		snprintf(module->text, sizeof module->text, "%u%%%s", capacity,
+			 !strcmp(status, "Charging") ? "+" : "");
+		break;
+	}
+	}
+}
+
+/* Tick on wall clock boundaries of module_interval, which divides every
+ * module period */
+static void
+arm_module_timer(void)
+{
+	time_t now = time(NULL);
+	struct itimerspec its = {
+		.it_value = { .tv_sec = now - now % module_interval + module_interval },
+		.it_interval = { .tv_sec = module_interval },
+	};
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) == -1)
+		EDIE("timerfd_settime");
+}
+
+/* Expand status_format and hand the result to every bar, unless nothing
+ * changed */
+static void
+apply_modules(bool force)
+{
+	static char last[sizeof sockbuf];
+	char text[sizeof sockbuf];
+	size_t len = 0;
+
+	for (uint32_t i = 0; i < modules_l; i++) {
+		modules[i].start = len;
+		len += snprintf(text + len, sizeof text - len, "%s",
+				modules[i].type == ModText ? modules[i].arg : modules[i].text);
+		len = MIN(len, sizeof text - 1);
+		modules[i].end = len;
+	}
+
+	if (!force && !strcmp(text, last))
+		return;
+	memcpy(last, text, len + 1);
+
+	customtext_unref(module_status);
+	module_status = parse_into_customtext(text);
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		set_customtext(&bar->status, module_status);
+		bar->dirty |= DirtyStatus;
+	}
+}
+
+/* Polled modules are due on wall clock multiples of their period, so they
+ * share wakeups. A late tick still catches up on everything it missed. */
+static void
+update_modules(bool force)
+{
+	time_t now = time(NULL);
+
+	for (uint32_t i = 0; i < modules_l; i++) {
+		Module *module = &modules[i];
+		if (module->type == ModText || !(force || (module->period && now >= module->due)))
+			continue;
+		update_module(module, now);
+		if (module->period)
+			module->due = now - now % module->period + module->period;
+	}
+
+	apply_modules(force);
+}
+
+static void
+read_timer(void *data, uint32_t events)
+{
+	uint64_t expirations;
+	bool force = false;
+
+	/* Missed expirations need no replay, due times cover them */
+	if (read(timer_fd, &expirations, sizeof expirations) == -1 && errno == ECANCELED) {
+		/* Clock was set, realign and update everything */
+		arm_module_timer();
+		force = true;
+	}
+	update_modules(force);
+}
+
+static void
+update_modules_of_type(uint32_t type)
+{
+	for (uint32_t i = 0; i < modules_l; i++)
+		if (modules[i].type == type)
+			update_module(&modules[i], 0);
+	apply_modules(false);
+}
+
+/* Every complete line from a block replaces its text. Persistent blocks
+ * that exit are restarted, backing off while they keep dying quickly. */
+static void
+read_block(void *data, uint32_t events)
+{
+	Module *module = (Module *)data;
+	ssize_t len;
+	bool changed = false;
+
+	while ((len = read(module->fd, module->line + module->line_l,
+			   sizeof module->line - 1 - module->line_l)) > 0) {
+		module->line_l += len;
+		char *nl;
+		while ((nl = memchr(module->line, '\n', module->line_l))) {
+			*nl = '\0';
+			snprintf(module->text, sizeof module->text, "%s", module->line);
+			module->line_l -= nl + 1 - module->line;
+			memmove(module->line, nl + 1, module->line_l);
+			changed = module->output = true;
+		}
+		if (module->line_l == sizeof module->line - 1) {
+			/* Overlong line, show what fits */
+			module->line[module->line_l] = '\0';
+			snprintf(module->text, sizeof module->text, "%s", module->line);
+			module->line_l = 0;
+			changed = module->output = true;
+		}
+	}
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		goto out;
+
+	if (module->line_l) {
+		module->line[module->line_l] = '\0';
+		snprintf(module->text, sizeof module->text, "%s", module->line);
+		changed = module->output = true;
+	}
+	event_remove(module->fd);
+	close(module->fd);
+	if (module->fd2 != -1)
+		close(module->fd2);
+	module->fd = module->fd2 = -1;
+	module->pid = 0;
+
+	uint64_t now = now_ms();
+	if (!module->period) {
+		if (now - module->started >= 10000)
+			module->backoff = 1000;
+		else
+			module->backoff = module->backoff ? MIN(module->backoff * 2, 60000) : 1000;
+		module->restart_at = now + module->backoff;
+	} else if (module->rerun) {
+		/* A click handler finished, refresh unless it printed the new text */
+		module->rerun = false;
+		module->refresh = !module->output;
+	}
+
+out:
+	if (changed)
+		apply_modules(false);
+}
+
+/* Run command with its stdout going to the block */
+static void
+spawn_block(Module *module, char *command, char **argv)
+{
+	int fds[2], in[2] = { -1, -1 };
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return;
+	}
+	/* Persistent blocks read their clicks from stdin */
+	if (!module->period && pipe2(in, O_CLOEXEC) == -1)
+		perror("pipe2");
+
+	pid_t pid = spawn(command, argv, in[0], fds[1]);
+	close(fds[1]);
+	if (in[0] != -1)
+		close(in[0]);
+	if (pid == -1) {
+		close(fds[0]);
+		if (in[1] != -1)
+			close(in[1]);
+		return;
+	}
+	if (in[1] != -1)
+		fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	if (event_add(fds[0], EPOLLIN, read_block, module) == -1) {
+		perror("epoll_ctl");
+		close(fds[0]);
+		if (in[1] != -1)
+			close(in[1]);
+		return;
+	}
+	module->fd = fds[0];
+	module->fd2 = in[1];
+	module->pid = pid;
+	module->started = now_ms();
+	module->line_l = 0;
+	module->output = false;
+}
+
+
+/* Start blocks that are due, click handlers first, and return the
+ * milliseconds until the next persistent block restarts, or -1 */
+static int64_t
+expire_blocks(void)
+{
+	uint64_t now = now_ms();
+	int64_t next = -1;
+
+	for (uint32_t i = 0; i < modules_l; i++) {
+		Module *module = &modules[i];
+		if (module->type != ModExec || module->fd != -1)
+			continue;
+		if (*module->click) {
+			char **argv = split_command(module->click);
+			spawn_block(module, module->click, argv);
+			free(argv);
+			*module->click = '\0';
+			module->rerun = true;
+			continue;
+		}
+		if (module->refresh) {
+			module->refresh = false;
+			spawn_block(module, module->cmd, module->argv);
+			continue;
+		}
+		if (module->period)
+			continue;
+		if (module->restart_at <= now) {
+			spawn_block(module, module->cmd, module->argv);
+			continue;
+		}
+		if (next == -1 || (int64_t)(module->restart_at - now) < next)
+			next = module->restart_at - now;
+	}
+
+	return next;
+}
+
+/* Files are watched through their directory so that replacing them,
+ * as editors and atomic writers do, is noticed too */
+static void
+read_inotify(void *data, uint32_t events)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	bool changed = false;
+
+	while ((len = read(inotify_fd, buf, sizeof buf)) > 0) {
+		for (char *p = buf; p < buf + len;) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			for (uint32_t i = 0; i < modules_l; i++) {
+				Module *module = &modules[i];
+				char *base = strrchr(module->arg, '/');
+				if (module->type == ModFile && module->wd == event->wd
+				    && event->len && !strcmp(event->name, base ? base + 1 : module->arg)) {
+					update_module(module, 0);
+					changed = true;
+				}
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	if (changed)
+		apply_modules(false);
+}
+
+/* Drain a netlink socket, returning whether anything arrived. For uevents
+ * only power supply changes count. */
+static bool
+drain_netlink(int fd, bool uevent)
+{
+	char buf[8192];
+	ssize_t len;
+	bool changed = false;
+
+	while ((len = recv(fd, buf, sizeof buf - 1, 0)) > 0) {
+		if (!uevent) {
+			changed = true;
+			continue;
+		}
+		/* Uevents are NUL-separated KEY=VALUE strings */
+		buf[len] = '\0';
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1)
+			if (!strcmp(p, "SUBSYSTEM=power_supply"))
+				changed = true;
+	}
+	return changed;
+}
+
+static void
+read_rtnl(void *data, uint32_t events)
+{
+	if (drain_netlink(rtnl_fd, false))
+		update_modules_of_type(ModNet);
+}
+
+static void
+read_uevent(void *data, uint32_t events)
+{
+	if (drain_netlink(uevent_fd, true))
+		update_modules_of_type(ModBat);
+}
+
+/* sysfs signals a change with EPOLLPRI */
+static void
+read_backlight(void *data, uint32_t events)
+{
+	update_module((Module *)data, 0);
+	apply_modules(false);
+}
+
+/* Listen to a netlink multicast group, or return -1 after saying why */
+static int
+netlink_listen(int type, int protocol, uint32_t groups, EventHandler handler)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = groups };
+	int fd = socket(AF_NETLINK, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof addr) == -1
+	    || event_add(fd, EPOLLIN, handler, NULL) == -1) {
+		fprintf(stderr, "Could not listen on netlink: %s\n", strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Event-driven modules whose events cannot be had are polled instead */
+static void
+setup_modules(void)
+{
+	uint32_t interval = 0;
+
+	parse_status_format(status_format);
+
+	for (uint32_t i = 0; i < modules_l; i++) {
+		Module *module = &modules[i];
+		char path[256];
+
+		module->fd = module->fd2 = module->wd = -1;
+		module->period = 1;
+		switch (module->type) {
+		case ModClock:
+			/* Minute resolution unless the format shows seconds */
+			module->period = 60;
+			for (char *p = module->arg; (p = strchr(p, '%')) && p[1]; p += 2)
+				if (strchr("STsrXc", p[1]))
+					module->period = 1;
+			break;
+		case ModCpu:
+			module->fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+			break;
+		case ModMem:
+			module->fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+			break;
+		case ModLoad:
+			module->period = 5;
+			module->fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC);
+			break;
+		case ModBat:
+			/* Uevents report plugging and unplugging right away, but many
+			 * batteries stay silent while discharging, so poll as well */
+			module->period = 60;
+			snprintf(path, sizeof path, "/sys/class/power_supply/%s/capacity",
+				 *module->arg ? module->arg : "BAT0");
+			module->fd = open(path, O_RDONLY | O_CLOEXEC);
+			snprintf(path, sizeof path, "/sys/class/power_supply/%s/status",
+				 *module->arg ? module->arg : "BAT0");
+			module->fd2 = open(path, O_RDONLY | O_CLOEXEC);
+			if (uevent_fd == -1)
+				uevent_fd = netlink_listen(SOCK_DGRAM, NETLINK_KOBJECT_UEVENT, 1, read_uevent);
+			break;
+		case ModExec: {
+			/* ^exec(INTERVAL COMMAND) */
+			char *end;
+			module->period = strtoul(module->arg, &end, 10);
+			module->cmd = end + strspn(end, " ");
+			module->argv = split_command(module->cmd);
+			break;
+		}
+		case ModFile: {
+			module->period = 0;
+			if (inotify_fd == -1) {
+				if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1
+				    || event_add(inotify_fd, EPOLLIN, read_inotify, NULL) == -1) {
+					fprintf(stderr, "inotify: %s\n", strerror(errno));
+					if (inotify_fd != -1)
+						close(inotify_fd);
+					inotify_fd = -1;
+				}
+			}
+			char *base = strrchr(module->arg, '/');
+			snprintf(path, sizeof path, "%.*s", base ? (int)(base - module->arg) + 1 : 1,
+				 base ? module->arg : ".");
+			if (inotify_fd == -1
+			    || (module->wd = inotify_add_watch(inotify_fd, path,
+							       IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+							       | IN_DELETE | IN_MOVED_FROM)) == -1) {
+				fprintf(stderr, "Could not watch '%s', polling it\n", path);
+				module->period = 5;
+			}
+			break;
+		}
+		case ModNet:
+			/* Link and address changes arrive over rtnetlink */
+			module->period = 0;
+			if (rtnl_fd == -1)
+				rtnl_fd = netlink_listen(SOCK_RAW, NETLINK_ROUTE,
+							 RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+							 read_rtnl);
+			if (rtnl_fd == -1)
+				module->period = 5;
+			break;
+		case ModBacklight: {
+			/* The backlight class notifies pollers of actual_brightness */
+			module->period = 0;
+			const char *dev = *module->arg ? module->arg : "intel_backlight";
+			snprintf(path, sizeof path, "/sys/class/backlight/%s/max_brightness", dev);
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			char buf[32];
+			unsigned long long max = 0;
+			if (read_module_file(fd, buf, sizeof buf) != -1)
+				sscanf(buf, "%llu", &max);
+			if (fd != -1)
+				close(fd);
+			module->max_brightness = max;
+			snprintf(path, sizeof path, "/sys/class/backlight/%s/actual_brightness", dev);
+			if ((module->fd = open(path, O_RDONLY | O_CLOEXEC)) != -1
+			    && event_add(module->fd, EPOLLPRI, read_backlight, module) == -1) {
+				perror("epoll_ctl");
+				module->period = 5;
+			}
+			break;
+		}
+		default:
+			continue;
+		}
+		/* Tick on the gcd of the periods so every boundary gets a tick */
+		for (uint32_t a = module->period; a;) {
+			uint32_t t = interval % a;
+			interval = a;
+			a = t;
+		}
+	}
+
+	/* A bar with only event-driven modules never wakes up on its own */
+	if (interval) {
+		if ((timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) == -1
+		    || event_add(timer_fd, EPOLLIN, read_timer, NULL) == -1)
+			EDIE("timerfd_create");
+		module_interval = interval;
+		arm_module_timer();
+	}
+
+	update_modules(true);
+}
+
+static void
+teardown_modules(void)
+{
+	for (uint32_t i = 0; i < modules_l; i++) {
+		if (modules[i].type == ModExec) {
+			stop_block(&modules[i]);
+			free(modules[i].argv);
+		}
+		if (modules[i].fd != -1)
+			close(modules[i].fd);
+		if (modules[i].fd2 != -1)
+			close(modules[i].fd2);
+		free(modules[i].arg);
+	}
+	free(modules);
+	if (timer_fd != -1)
+		close(timer_fd);
+	if (inotify_fd != -1)
+		close(inotify_fd);
+	if (rtnl_fd != -1)
+		close(rtnl_fd);
+	if (uevent_fd != -1)
+		close(uevent_fd);
+	customtext_unref(module_status);
+}
+
+/* Everything but Wayland goes through registered sources. The display is
+ * read with prepare_read/read_events so that queued events are always
+ * dispatched before sleeping. */
 static void
 event_loop(void)
 {
 	int wl_fd = wl_display_get_fd(display);
+	struct epoll_event events[32];
+	bool wl_writing = false;
+	Client *client, *client2;
 
-	while (run_display) {
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(wl_fd, &rfds);
-		FD_SET(sock_fd, &rfds);
-		if (!ipc)
-			FD_SET(STDIN_FILENO, &rfds);
+	if (event_add(wl_fd, EPOLLIN, NULL, NULL) == -1)
+		EDIE("epoll_ctl");
 
-		wl_display_flush(display);
+	while (run_display) {
+		int64_t timeout = expire_clients(), blocks = expire_blocks();
+		if (blocks != -1 && (timeout == -1 || blocks < timeout))
+			timeout = blocks;
+
+		while (wl_display_prepare_read(display) == -1)
+			if (wl_display_dispatch_pending(display) == -1)
+				return;
+
+		/* Wait for the socket to drain if the compositor is slow */
+		bool flushed = wl_display_flush(display) != -1;
+		if (!flushed && errno != EAGAIN) {
+			wl_display_cancel_read(display);
+			return;
+		}
+		if (flushed == wl_writing) {
+			wl_writing = !flushed;
+			event_modify(wl_fd, wl_writing ? EPOLLIN | EPOLLOUT : EPOLLIN);
+		}
 
-		if (select(MAX(sock_fd, wl_fd) + 1, &rfds, NULL, NULL, NULL) == -1) {
+		int n = epoll_wait(epoll_fd, events, LENGTH(events), timeout);
+		if (n == -1) {
+			wl_display_cancel_read(display);
 			if (errno == EINTR)
 				continue;
-			else
-				EDIE("select");
+			EDIE("epoll_wait");
+		}
+
+		bool wl_readable = false;
+		for (int i = 0; i < n; i++)
+			if ((int)(uint32_t)events[i].data.u64 == wl_fd && (events[i].events & ~EPOLLOUT))
+				wl_readable = true;
+		if (wl_readable) {
+			if (wl_display_read_events(display) == -1)
+				return;
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) == -1)
+			return;
+
+		/* Anything but a finished frame may have fixed a failed render */
+		bool retry = wl_readable;
+		for (int i = 0; i < n; i++) {
+			EventSource *source = &sources[(uint32_t)events[i].data.u64];
+			if (source->handler && source->gen == events[i].data.u64 >> 32) {
+				source->handler(source->data, events[i].events);
+				retry |= source->handler != read_frames;
+			}
 		}
 		
-		if (FD_ISSET(wl_fd, &rfds))
-			if (wl_display_dispatch(display) == -1)
-				break;
-		if (FD_ISSET(sock_fd, &rfds))
-			read_socket();
-		if (!ipc && FD_ISSET(STDIN_FILENO, &rfds))
-			read_stdin();
-		
+		/* Subscribers that fell behind are only marked while publishing */
+		wl_list_for_each_safe(client, client2, &client_list, link)
+			if (client->dead)
+				close_client(client);
+
 		Bar *bar;
 		wl_list_for_each(bar, &bar_list, link) {
-			if (bar->redraw) {
-				if (!bar->hidden)
-					draw_frame(bar);
-				bar->redraw = false;
-			}
+			if (retry)
+				bar->render_failed = false;
+			/* Unconfigured bars have no size to render at, the
+			 * configure draws them */
+			if (bar->dirty && bar->configured && !bar->render_failed
+			    && !bar->hidden && !bar->fullscreen && !bar->powered_off)
+				draw_frame(bar);
 		}
 	}
 }
 
+/* Collect all running dwlb instances from the registry, or target_socket
+ * only. Entries whose process is gone or not ours are skipped. */
+static Target *
+client_find_targets(const char *target_socket, uint32_t *targets_l)
+{
+	Target *targets = NULL;
+	uint32_t targets_c = 0;
+	char buf[4096];
+
+	*targets_l = 0;
+
+	int fd = open(registrypath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	flock(fd, LOCK_SH);
+	ssize_t len = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	buf[MAX(len, 0)] = '\0';
+
+	char name[16];
+	int pid, n;
+	for (char *p = buf; sscanf(p, "%15s %d\n%n", name, &pid, &n) == 2; p += n) {
+		if (target_socket && strcmp(name, target_socket))
+			continue;
+		if (kill(pid, 0) == -1)
+			continue;
+		Target *target;
+		ARRAY_APPEND(targets, *targets_l, targets_c, target);
+		memset(target, 0, sizeof(*target));
+		snprintf(target->name, sizeof target->name, "%s", name);
+		target->fd = -1;
+	}
+
+	return targets;
+}
+
+/* Anyone can bind an abstract name, so only talk to our own user */
+static int
+client_connect(struct sockaddr_un *sock_address, Target *target)
+{
+	if ((target->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 1)) == -1)
+		EDIE("socket");
+	socklen_t len = abstract_address(sock_address, target->name, "");
+	struct ucred cred;
+	socklen_t cred_len = sizeof cred;
+	if (connect(target->fd, (struct sockaddr *)sock_address, len) == -1
+	    || getsockopt(target->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1
+	    || cred.uid != getuid()) {
+		close(target->fd);
+		target->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Instances listen for datagrams on socketdir/<name>.dgram. Once that fails
+ * the target sticks to the stream socket. */
+static int
+client_send_dgram(struct sockaddr_un *sock_address, Target *target, const char *data, size_t len)
+{
+	static int fd = -1;
+
+	if (target->no_dgram)
+		return -1;
+	if (fd == -1 && (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		EDIE("socket");
+	socklen_t addr_len = socket_path(sock_address, target->name, ".dgram");
+	if (sendto(fd, data, len, 0, (struct sockaddr *)sock_address, addr_len) == (ssize_t)len)
+		return 0;
+	target->no_dgram = true;
+	return -1;
+}
+
+/* Ask an instance for a ring on the target's stream connection */
+static void
+client_ring_open(struct sockaddr_un *sock_address, Target *target)
+{
+	if (client_connect(sock_address, target) == -1)
+		return;
+	if (send(target->fd, "ring\n", 5, MSG_NOSIGNAL) == -1)
+		return;
+	/* An instance with rings answers at once, one that has none never
+	 * does, so do not wait long before sticking to the stream */
+	setsockopt(target->fd, SOL_SOCKET, SO_RCVTIMEO,
+		   &(struct timeval){ .tv_usec = 20000 }, sizeof(struct timeval));
+
+	char reply[5];
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = reply, .iov_len = sizeof reply };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof control.buf
+	};
+	if (recvmsg(target->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof reply)
+		return;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+		return;
+	int fds[2];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+	struct stat st;
+	Ring *ring = MAP_FAILED;
+	if (fstat(fds[0], &st) == 0 && st.st_size > (off_t)sizeof(Ring))
+		ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (ring == MAP_FAILED || ring->size != st.st_size - sizeof(Ring)) {
+		if (ring != MAP_FAILED)
+			munmap(ring, st.st_size);
+		close(fds[1]);
+		return;
+	}
+
+	target->ring = ring;
+	target->ring_efd = fds[1];
+	target->ring_mapsize = st.st_size;
+}
+
 static void
-client_send_command(struct sockaddr_un *sock_address, const char *output,
-		    const char *cmd, const char *data, const char *target_socket)
+client_ring_close(Target *target)
 {
-	DIR *dir;
-	if (!(dir = opendir(socketdir)))
-		EDIE("Could not open directory '%s'", socketdir);
+	munmap(target->ring, target->ring_mapsize);
+	close(target->ring_efd);
+	target->ring = NULL;
+}
 
+/* Publish one record and wake dwlb. The stream is only checked for a
+ * vanished instance when the previous record is still unconsumed. Fails
+ * when dwlb is too far behind for the record to fit. */
+static int
+client_ring_write(Target *target, const char *data, uint32_t len)
+{
+	Ring *ring = target->ring;
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head != tail) {
+		char c;
+		ssize_t rv = recv(target->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (rv == 0 || (rv == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+			return -1;
+	}
+	if (ring->size - (head - tail) < sizeof len + len)
+		return -1;
+
+	for (uint32_t i = 0; i < 2; i++) {
+		const char *src = i ? data : (const char *)&len;
+		uint32_t n = i ? len : sizeof len;
+		uint32_t off = head % ring->size, first = MIN(n, ring->size - off);
+		memcpy(ring->data + off, src, first);
+		memcpy(ring->data, src + first, n - first);
+		head += n;
+	}
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+
+	uint64_t one = 1;
+	if (write(target->ring_efd, &one, sizeof one) == -1 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+static int
+client_send_line(struct sockaddr_un *sock_address, Target *target, const char *line, size_t len)
+{
+	if (target->ring) {
+		if (client_ring_write(target, line, len) == 0)
+			return 0;
+		/* Continue on the stream, which dwlb reads only after the ring.
+		 * Datagrams would overtake it. */
+		client_ring_close(target);
+		target->no_dgram = true;
+	}
+
+	if (client_send_dgram(sock_address, target, line, len) == 0)
+		return 0;
+
+	/* Retry once on a fresh connection if the instance dropped us */
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (target->fd == -1 && client_connect(sock_address, target) == -1)
+			return -1;
+		if (send(target->fd, line, len, MSG_NOSIGNAL) == (ssize_t)len)
+			return 0;
+		close(target->fd);
+		target->fd = -1;
+	}
+	return -1;
+}
+
+/* Commands given on the command line are collected into sockbuf and sent
+ * as one message, which instances apply before redrawing once */
+static void
+client_queue_command(const char *output, const char *cmd, const char *data)
+{
+	size_t len = strlen(sockbuf);
+	int n;
 	if (data)
-		snprintf(sockbuf, sizeof sockbuf, "%s %s %s", output, cmd, data);
+		n = snprintf(sockbuf + len, sizeof sockbuf - len, "%s %s %s\n", output, cmd, data);
 	else
-		snprintf(sockbuf, sizeof sockbuf, "%s %s", output, cmd);
-	
+		n = snprintf(sockbuf + len, sizeof sockbuf - len, "%s %s\n", output, cmd);
+	if (n < 0 || (size_t)n >= sizeof sockbuf - len)
+		DIE("Commands exceed %zu bytes", sizeof sockbuf);
+
+	/* Newlines in the text would split the command */
+	for (char *p = sockbuf + len; p < sockbuf + len + n - 1; p++)
+		if (*p == '\n')
+			*p = ' ';
+}
+
+static void
+client_send_commands(struct sockaddr_un *sock_address, const char *target_socket)
+{
 	size_t len = strlen(sockbuf);
-			
-	struct dirent *de;
-	bool newfd = true;
+	uint32_t targets_l;
+	Target *targets = client_find_targets(target_socket, &targets_l);
 
 	/* Send data to all dwlb instances */
-	while ((de = readdir(dir))) {
-		if (!strncmp(de->d_name, "dwlb-", 5)) {
-			if (!target_socket || !strncmp(de -> d_name, target_socket, 6)){
-				if (newfd && (sock_fd = socket(AF_UNIX, SOCK_STREAM, 1)) == -1)
-					EDIE("socket");
-				snprintf(sock_address->sun_path, sizeof sock_address->sun_path, "%s/%s", socketdir, de->d_name);
-				if (connect(sock_fd, (struct sockaddr *) sock_address, sizeof(*sock_address)) == -1) {
-					newfd = false;
-					continue;
-				}
-				if (send(sock_fd, sockbuf, len, 0) == -1)
-					fprintf(stderr, "Could not send status data to '%s'\n", sock_address->sun_path);
-				close(sock_fd);
-				newfd = true;
+	for (uint32_t i = 0; i < targets_l; i++) {
+		if (client_send_dgram(sock_address, &targets[i], sockbuf, len) == 0)
+			continue;
+		if (client_connect(sock_address, &targets[i]) == -1)
+			continue;
+		/* A stream may be read in pieces, so frame the batch explicitly */
+		if (send(targets[i].fd, "begin\n", 6, MSG_NOSIGNAL) == -1
+		    || send(targets[i].fd, sockbuf, len, MSG_NOSIGNAL) == -1
+		    || send(targets[i].fd, "commit\n", 7, MSG_NOSIGNAL) == -1)
+			fprintf(stderr, "Could not send status data to '%s'\n", targets[i].name);
+		close(targets[i].fd);
+	}
+
+	free(targets);
+}
+
+/* Stream stdin lines as status updates, as datagrams or over one connection
+ * per instance. Instances are looked up once and only again when none is
+ * reachable. */
+static void
+client_stream_stdin(struct sockaddr_un *sock_address, const char *output,
+		    const char *target_socket)
+{
+	Target *targets = NULL;
+	uint32_t targets_l = 0;
+	char *status = malloc(TEXT_MAX * sizeof(char));
+	if (!status)
+		EDIE("malloc");
+
+	while (fgets(status, TEXT_MAX-1, stdin)) {
+		status[strcspn(status, "\n")] = '\0';
+		int len = snprintf(sockbuf, sizeof sockbuf, "%s status %s\n", output, status);
+		if (len >= (int)sizeof sockbuf) {
+			sockbuf[sizeof sockbuf - 2] = '\n';
+			len = sizeof sockbuf - 1;
+		}
+
+		if (!targets_l) {
+			free(targets);
+			targets = client_find_targets(target_socket, &targets_l);
+			for (uint32_t i = 0; i < targets_l; i++)
+				client_ring_open(sock_address, &targets[i]);
+		}
+
+		for (uint32_t i = 0; i < targets_l;) {
+			if (client_send_line(sock_address, &targets[i], sockbuf, len) == -1) {
+				/* Stale socket or instance gone */
+				targets[i] = targets[--targets_l];
+				continue;
 			}
+			i++;
 		}
 	}
 
-	closedir(dir);
+	for (uint32_t i = 0; i < targets_l; i++) {
+		if (targets[i].ring)
+			client_ring_close(&targets[i]);
+		if (targets[i].fd != -1)
+			close(targets[i].fd);
+	}
+	free(targets);
+	free(status);
+}
+
+/* Print the event stream of the first reachable instance */
+static void
+client_subscribe(struct sockaddr_un *sock_address, const char *target_socket)
+{
+	uint32_t targets_l, i;
+	Target *targets = client_find_targets(target_socket, &targets_l);
+
+	for (i = 0; i < targets_l; i++)
+		if (client_connect(sock_address, &targets[i]) == 0)
+			break;
+	if (i == targets_l)
+		DIE("Could not connect to a dwlb instance");
+
+	int fd = targets[i].fd;
+	free(targets);
+	if (send(fd, "subscribe\n", 10, MSG_NOSIGNAL) == -1)
+		EDIE("send");
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	ssize_t len;
+	while ((len = recv(fd, sockbuf, sizeof sockbuf, 0)) > 0)
+		if (fwrite(sockbuf, 1, len, stdout) != (size_t)len)
+			break;
+	close(fd);
 }
 
-void
-sig_handler(int sig)
+static void
+read_signals(void *data, uint32_t events)
 {
-	if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM)
-		run_display = false;
+	struct signalfd_siginfo info;
+
+	while (read(signal_fd, &info, sizeof info) == sizeof info) {
+		if (info.ssi_signo == SIGCHLD)
+			reap_children();
+		else
+			run_display = false;
+	}
 }
 
 int
@@ -1685,13 +4311,15 @@ main(int argc, char **argv)
 {
 	char *xdgruntimedir;
 	struct sockaddr_un sock_address;
-	Bar *bar, *bar2;
+	Bar *bar;
 	Seat *seat, *seat2;
+	Client *client, *client2;
 
 	/* Establish socket directory */
 	if (!(xdgruntimedir = getenv("XDG_RUNTIME_DIR")))
 		DIE("Could not retrieve XDG_RUNTIME_DIR");
 	snprintf(socketdir, sizeof socketdir, "%s/dwlb", xdgruntimedir);
+	snprintf(registrypath, sizeof registrypath, "%s/instances", socketdir);
 	if (mkdir(socketdir, S_IRWXU) == -1)
 		if (errno != EEXIST)
 			EDIE("Could not create directory '%s'", socketdir);
@@ -1711,52 +4339,44 @@ main(int argc, char **argv)
 		if (!strcmp(argv[i], "-status")) {
 			if (++i + 1 >= argc)
 				DIE("Option -status requires two arguments");
-			client_send_command(&sock_address, argv[i], "status", argv[i + 1], target_socket);
-			return 0;
+			client_queue_command(argv[i], "status", argv[i + 1]);
+			i++;
 		} else if (!strcmp(argv[i], "-status-stdin")) {
 			if (++i >= argc)
 				DIE("Option -status-stdin requires an argument");
-			char *status = malloc(TEXT_MAX * sizeof(char));
-			while (fgets(status, TEXT_MAX-1, stdin)) {
-				status[strlen(status)-1] = '\0';
-				client_send_command(&sock_address, argv[i], "status", status, target_socket);
-			}
-			free(status);
+			client_stream_stdin(&sock_address, argv[i], target_socket);
 			return 0;
 		} else if (!strcmp(argv[i], "-title")) {
 			if (++i + 1 >= argc)
 				DIE("Option -title requires two arguments");
-			client_send_command(&sock_address, argv[i], "title", argv[i + 1], target_socket);
-			return 0;
+			client_queue_command(argv[i], "title", argv[i + 1]);
+			i++;
 		} else if (!strcmp(argv[i], "-show")) {
 			if (++i >= argc)
 				DIE("Option -show requires an argument");
-			client_send_command(&sock_address, argv[i], "show", NULL, target_socket);
-			return 0;
+			client_queue_command(argv[i], "show", NULL);
 		} else if (!strcmp(argv[i], "-hide")) {
 			if (++i >= argc)
 				DIE("Option -hide requires an argument");
-			client_send_command(&sock_address, argv[i], "hide", NULL, target_socket);
-			return 0;
+			client_queue_command(argv[i], "hide", NULL);
 		} else if (!strcmp(argv[i], "-toggle-visibility")) {
 			if (++i >= argc)
 				DIE("Option -toggle requires an argument");
-			client_send_command(&sock_address, argv[i], "toggle-visibility", NULL, target_socket);
-			return 0;
+			client_queue_command(argv[i], "toggle-visibility", NULL);
 		} else if (!strcmp(argv[i], "-set-top")) {
 			if (++i >= argc)
 				DIE("Option -set-top requires an argument");
-			client_send_command(&sock_address, argv[i], "set-top", NULL, target_socket);
-			return 0;
+			client_queue_command(argv[i], "set-top", NULL);
 		} else if (!strcmp(argv[i], "-set-bottom")) {
 			if (++i >= argc)
 				DIE("Option -set-bottom requires an argument");
-			client_send_command(&sock_address, argv[i], "set-bottom", NULL, target_socket);
-			return 0;
+			client_queue_command(argv[i], "set-bottom", NULL);
 		} else if (!strcmp(argv[i], "-toggle-location")) {
 			if (++i >= argc)
 				DIE("Option -toggle-location requires an argument");
-			client_send_command(&sock_address, argv[i], "toggle-location", NULL, target_socket);
+			client_queue_command(argv[i], "toggle-location", NULL);
+		} else if (!strcmp(argv[i], "-subscribe")) {
+			client_subscribe(&sock_address, target_socket);
 			return 0;
 		} else if (!strcmp(argv[i], "-ipc")) {
 			ipc = true;
@@ -1790,6 +4410,22 @@ main(int argc, char **argv)
 			active_color_title = true;
 		} else if (!strcmp(argv[i], "-no-active-color-title")) {
 			active_color_title = false; 
+		} else if (!strcmp(argv[i], "-fullscreen-release-zone")) {
+			fullscreen_release_zone = true;
+		} else if (!strcmp(argv[i], "-no-fullscreen-release-zone")) {
+			fullscreen_release_zone = false;
+		} else if (!strcmp(argv[i], "-output-power")) {
+			follow_output_power = true;
+		} else if (!strcmp(argv[i], "-no-output-power")) {
+			follow_output_power = false;
+		} else if (!strcmp(argv[i], "-state-file")) {
+			state_file = true;
+		} else if (!strcmp(argv[i], "-no-state-file")) {
+			state_file = false;
+		} else if (!strcmp(argv[i], "-status-format")) {
+			if (++i >= argc)
+				DIE("Option -status-format requires an argument");
+			status_format = argv[i];
 		} else if (!strcmp(argv[i], "-font")) {
 			if (++i >= argc)
 				DIE("Option -font requires an argument");
@@ -1881,6 +4517,11 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (*sockbuf) {
+		client_send_commands(&sock_address, target_socket);
+		return 0;
+	}
+
 	/* Set up display and protocols */
 	display = wl_display_connect(NULL);
 	if (!display)
@@ -1888,25 +4529,19 @@ main(int argc, char **argv)
 
 	wl_list_init(&bar_list);
 	wl_list_init(&seat_list);
+	wl_list_init(&client_list);
+	wl_list_init(&scale_list);
 	
 	struct wl_registry *registry = wl_display_get_registry(display);
 	wl_registry_add_listener(registry, &registry_listener, NULL);
 	wl_display_roundtrip(display);
-	if (!compositor || !shm || !layer_shell || !output_manager || (ipc && !dwl_wm))
+	if (!compositor || !shm || !layer_shell || (ipc && !dwl_wm))
 		DIE("Compositor does not support all needed protocols");
 
-	/* Load selected font */
+	/* Fonts are loaded per scale as bars need them */
 	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
 	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
 
-	unsigned int dpi = 96 * buffer_scale;
-	char buf[10];
-	snprintf(buf, sizeof buf, "dpi=%u", dpi);
-	if (!(font = fcft_from_name(1, (const char *[]) {fontstr}, buf)))
-		DIE("Could not load font");
-	textpadding = font->height / 2;
-	height = font->height / buffer_scale + vertical_padding * 2;
-
 	/* Configure tag names */
 	if (!ipc && !tags) {
 		if (!(tags = malloc(LENGTH(tags_names) * sizeof(char *))))
@@ -1917,61 +4552,136 @@ main(int argc, char **argv)
 				EDIE("strdup");
 	}
 	
-	/* Setup bars */
-	wl_list_for_each(bar, &bar_list, link)
-		setup_bar(bar);
+	/* Start the render thread with every signal blocked, they are all
+	 * handled by the main thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	if ((render_efd = eventfd(0, EFD_CLOEXEC)) == -1
+	    || (done_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		EDIE("eventfd");
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if ((errno = pthread_create(&render_tid, NULL, render_thread, NULL)))
+		EDIE("pthread_create");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* Setup bars as their outputs send done, and the rest after that */
+	run_display = true;
 	wl_display_roundtrip(display);
+	for (uint32_t i = 0; i < INDEX_SIZE; i++)
+		for (bar = bars_by_id[i]; bar; bar = bar->id_next)
+			if (!bar->scale)
+				setup_bar(bar);
+	wl_display_roundtrip(display);
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	    || event_add(done_efd, EPOLLIN, read_frames, NULL) == -1)
+		EDIE("epoll");
 
 	if (!ipc) {
 		/* Configure stdin */
 		if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
 			EDIE("fcntl");
-	
-		/* Allocate stdin buffer */
-		if (!(stdinbuf = malloc(1024)))
-			EDIE("malloc");
-		stdinbuf_cap = 1024;
+		/* Regular files and /dev/null cannot be polled, they are read
+		 * up to the end right away */
+		if (event_add(STDIN_FILENO, EPOLLIN, read_stdin, NULL) == -1) {
+			if (errno != EPERM)
+				EDIE("epoll_ctl");
+			while (run_display)
+				read_stdin(NULL, 0);
+		}
 	}
 
-	/* Set up socket */
+	/* Set up sockets, taking the first free instance name */
+	if ((sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 1)) == -1)
+		EDIE("socket");
 	bool found = false;
 	for (uint32_t i = 0; i < 50; i++) {
-		if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 1)) == -1)
-			DIE("socket");
-		snprintf(sock_address.sun_path, sizeof sock_address.sun_path, "%s/dwlb-%i", socketdir, i);
-		if (connect(sock_fd, (struct sockaddr *)&sock_address, sizeof sock_address) == -1) {
+		snprintf(instance_name, sizeof instance_name, "dwlb-%u", i);
+		socklen_t len = abstract_address(&sock_address, instance_name, "");
+		if (bind(sock_fd, (struct sockaddr *)&sock_address, len) == 0) {
 			found = true;
 			break;
 		}
-		close(sock_fd);
+		if (errno != EADDRINUSE)
+			EDIE("bind");
+	}
+	if (!found) {
+		*instance_name = '\0';
+		DIE("Could not secure a socket name");
 	}
-	if (!found)
-		DIE("Could not secure a socket path");
-
-	socketpath = (char *)&sock_address.sun_path;
-	unlink(socketpath);
-	if (bind(sock_fd, (struct sockaddr *)&sock_address, sizeof sock_address) == -1)
-		EDIE("bind");
 	if (listen(sock_fd, SOMAXCONN) == -1)
 		EDIE("listen");
-	fcntl(sock_fd, F_SETFD, FD_CLOEXEC | fcntl(sock_fd, F_GETFD));
 
-	/* Set up signals */
-	signal(SIGINT, sig_handler);
-	signal(SIGHUP, sig_handler);
-	signal(SIGTERM, sig_handler);
-	signal(SIGCHLD, SIG_IGN);
+	/* Datagram endpoint next to the stream socket for one-shot commands */
+	socklen_t dgram_len = socket_path(&sock_address, instance_name, ".dgram");
+	if ((dgram_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		EDIE("socket");
+	/* The name is ours now, anything left there is from a crashed instance */
+	unlink(sock_address.sun_path);
+	if (bind(dgram_fd, (struct sockaddr *)&sock_address, dgram_len) == -1
+	    || setsockopt(dgram_fd, SOL_SOCKET, SO_PASSCRED, &(int){ 1 }, sizeof(int)) == -1) {
+		fprintf(stderr, "Could not set up datagram socket: %s\n", strerror(errno));
+		close(dgram_fd);
+		dgram_fd = -1;
+	}
+
+	if (event_add(sock_fd, EPOLLIN, accept_clients, NULL) == -1
+	    || (dgram_fd != -1 && event_add(dgram_fd, EPOLLIN, read_dgram, NULL) == -1))
+		EDIE("epoll_ctl");
+
+	update_registry(true);
+
+	/* The state file is named after the instance */
+	setup_cache();
+
+	/* Set up signals, delivered through the event loop */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	/* A block that exits leaves its stdin without a reader */
+	signal(SIGPIPE, SIG_IGN);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1
+	    || (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1
+	    || event_add(signal_fd, EPOLLIN, read_signals, NULL) == -1)
+		EDIE("signalfd");
+
+	/* Set up built-in status modules */
+	if (status_format)
+		setup_modules();
 	
 	/* Run */
-	run_display = true;
 	event_loop();
 
 	/* Clean everything up */
+	atomic_store(&render_stop, true);
+	eventfd_write(render_efd, 1);
+	pthread_join(render_tid, NULL);
+	Frame *frame;
+	while ((frame = queue_pop(&render_queue)))
+		free_frame(frame);
+	while ((frame = queue_pop(&done_queue)))
+		free_frame(frame);
+	close(render_efd);
+	close(done_efd);
+
+	wl_list_for_each_safe(client, client2, &client_list, link)
+		close_client(client);
 	close(sock_fd);
-	unlink(socketpath);
+	if (dgram_fd != -1) {
+		close(dgram_fd);
+		socket_path(&sock_address, instance_name, ".dgram");
+		unlink(sock_address.sun_path);
+	}
+	update_registry(false);
 	
-	if (!ipc)
-		free(stdinbuf);
+	if (status_format)
+		teardown_modules();
+	close(signal_fd);
+	close(epoll_fd);
+	free(sources);
 
 	if (tags) {
 		for (uint32_t i = 0; i < tags_l; i++)
@@ -1983,18 +4693,42 @@ main(int argc, char **argv)
 			free(layouts[i]);
 		free(layouts);
 	}
+	for (uint32_t i = 0; i < CACHE_ENTRIES; i++) {
+		customtext_unref(cached[i][0]);
+		customtext_unref(cached[i][1]);
+	}
+	if (cache_mapped)
+		munmap(cache, sizeof(Cache));
+	else
+		free(cache);
 
-	wl_list_for_each_safe(bar, bar2, &bar_list, link)
-		teardown_bar(bar);
+	for (uint32_t i = 0; i < INDEX_SIZE; i++) {
+		while ((bar = bars_by_id[i])) {
+			bars_by_id[i] = bar->id_next;
+			wl_list_remove(&bar->link);
+			teardown_bar(bar);
+		}
+	}
 	wl_list_for_each_safe(seat, seat2, &seat_list, link)
 		teardown_seat(seat);
 	
 	zwlr_layer_shell_v1_destroy(layer_shell);
-	zxdg_output_manager_v1_destroy(output_manager);
+	if (output_manager)
+		zxdg_output_manager_v1_destroy(output_manager);
 	if (ipc)
 		zdwl_ipc_manager_v2_destroy(dwl_wm);
+	if (power_manager)
+		zwlr_output_power_manager_v1_destroy(power_manager);
 	
-	fcft_destroy(font);
+	Scale *scale, *scale2;
+	wl_list_for_each_safe(scale, scale2, &scale_list, link) {
+		fcft_destroy(scale->font);
+		if (scale->cursor_theme) {
+			wl_surface_destroy(scale->cursor_surface);
+			wl_cursor_theme_destroy(scale->cursor_theme);
+		}
+		free(scale);
+	}
 	fcft_fini();
 	
 	wl_shm_destroy(shm);